@@ -3,6 +3,7 @@
 #define CHARDEV_H
 
 #include <linux/ioctl.h>
+#include <linux/types.h>
 
 #define MAJOR_NUM 100
 
@@ -26,7 +27,445 @@
 
 #define IOCTL_BAROMETER_PRESSURE _IOWR(MAJOR_NUM, 9, char *)
 
-#define DEVICE_FILE_NAME "/dev/imu_char"
+/*
+ * Channel indices, in the same order as the per-channel ioctls above.
+ */
+enum imu_channel {
+	IMU_CHAN_GYRO_X = 0,
+	IMU_CHAN_GYRO_Y,
+	IMU_CHAN_GYRO_Z,
+	IMU_CHAN_ACCEL_X,
+	IMU_CHAN_ACCEL_Y,
+	IMU_CHAN_ACCEL_Z,
+	IMU_CHAN_MAGN_X,
+	IMU_CHAN_MAGN_Y,
+	IMU_CHAN_MAGN_Z,
+	IMU_CHAN_PRESSURE,
+	IMU_NUM_CHANNELS
+};
+
+/*
+ * Raw values are ADC counts in 0..1022. The signed axes read
+ * IMU_ADC_ZERO at rest; the gyroscope has 1 deg/s per count and the
+ * accelerometer IMU_ACCEL_1G counts per g.
+ */
+#define IMU_ADC_ZERO 512
+#define IMU_ACCEL_1G 256
+
+/*
+ * Virtual channel carrying the orientation computed by the fusion mode
+ * (IOCTL_SET_FUSION): a unit quaternion in Q14 and roll/pitch/yaw in
+ * hundredths of a degree. It follows the raw channels in scan masks.
+ */
+#define IMU_CHAN_ORIENTATION IMU_NUM_CHANNELS
+
+/*
+ * Virtual channel carrying the record's sequence number: one per record
+ * offered to the sample ring, counting those dropped or skipped, so a gap
+ * shows exactly which records a reader missed.
+ */
+#define IMU_CHAN_SEQ (IMU_NUM_CHANNELS + 1)
+
+/*
+ * Clock a record's timestamp_ns is taken from, as reported in
+ * struct imu_ring_ctrl and struct imu_info. IMU_CLOCK_MONOTONIC has the
+ * value of CLOCK_MONOTONIC; IMU_CLOCK_TRACE means the timestamps are the
+ * ones recorded in a trace being replayed.
+ */
+#define IMU_CLOCK_MONOTONIC 1
+#define IMU_CLOCK_TRACE 0x100
+
+/*
+ * One reading of every channel, taken at the same instant. The timestamp
+ * is the instant the sample was acquired, not when it was read, so
+ * batching reads costs no timing accuracy. quat and euler are 0 unless
+ * the fusion mode is on; seq is 0 outside the sample ring.
+ */
+struct imu_sample {
+	__u64 timestamp_ns;			/* see clock_id, in ns */
+	__u32 seq;				/* see IMU_CHAN_SEQ, wraps */
+	__u16 channel[IMU_NUM_CHANNELS];	/* indexed by enum imu_channel */
+	__s16 quat[4];				/* w, x, y, z in Q14 */
+	__s16 euler[3];				/* roll, pitch, yaw, 0.01 deg */
+	__u16 reserved;				/* keeps the size a multiple of 8 */
+};
+
+/* Fill a struct imu_sample with all ten channels in a single call */
+#define IOCTL_READ_ALL_CHANNELS _IOR(MAJOR_NUM, 10, struct imu_sample)
+
+/*
+ * The driver samples all channels on its own at a configurable rate and
+ * queues each reading as a struct imu_sample. read() returns as many
+ * whole records as fit in the buffer. splice() and sendfile() work the
+ * same way, moving records into a pipe, file or socket without passing
+ * through user memory.
+ */
+#define IOCTL_SET_SAMPLE_RATE _IOW(MAJOR_NUM, 11, __u32)	/* Hz */
+
+/*
+ * The sample ring can also be mmap()ed (MAP_SHARED, offset 0) to read
+ * records without copying, in the style of the perf ring buffer. The
+ * first page is a struct imu_ring_ctrl; data_size records of record_size
+ * bytes follow at data_offset. A reader:
+ *
+ *	head = __atomic_load_n(&ctrl->data_head, __ATOMIC_ACQUIRE);
+ *	while (tail != head)
+ *		consume(&data[tail++ & (ctrl->data_size - 1)]);
+ *	__atomic_store_n(&ctrl->data_tail, tail, __ATOMIC_RELEASE);
+ *
+ * and calls IOCTL_WAIT_SAMPLES to sleep while the ring is empty. Every
+ * open file reads the ring through its own cursor; only one file at a time
+ * may map it (others get -EBUSY), and data_tail is that file's cursor.
+ * The mapping file holds the producer back, so it must first leave the
+ * default IMU_OVERRUN_OVERWRITE policy, see IOCTL_SET_OVERRUN.
+ */
+#define IMU_RING_VERSION 1
+
+struct imu_ring_ctrl {
+	__u32 version;		/* IMU_RING_VERSION */
+	__u32 record_size;	/* sizeof(struct imu_sample) */
+	__u32 data_offset;	/* byte offset of the first record */
+	__u32 data_size;	/* number of records, a power of two */
+	__u32 clock_id;		/* IMU_CLOCK_* of the records' timestamps */
+	__u8  __pad0[44];
+	__u64 data_head;	/* written by the driver */
+	__u8  __pad1[56];	/* keep head and tail on separate lines */
+	__u64 data_tail;	/* written by the reader */
+};
+
+#define IOCTL_WAIT_SAMPLES _IO(MAJOR_NUM, 12)
+
+/*
+ * Readers blocked in read(), poll() or IOCTL_WAIT_SAMPLES on this file are
+ * only woken once this many samples are queued (default 1, at most
+ * data_size).
+ */
+#define IOCTL_SET_WATERMARK _IOW(MAJOR_NUM, 13, __u32)
+
+/*
+ * The newest sample is also published on its own, for readers that want
+ * no history. IOCTL_READ_LATEST copies it out; without a syscall it can
+ * be read from a page mapped read-only at IMU_MMAP_LATEST_OFFSET, which
+ * any number of files may map:
+ *
+ *	do {
+ *		seq = __atomic_load_n(&l->seq, __ATOMIC_ACQUIRE);
+ *		copy = l->sample;
+ *		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+ *	} while ((seq & 1) || seq != __atomic_load_n(&l->seq, __ATOMIC_RELAXED));
+ */
+#define IMU_MMAP_LATEST_OFFSET 0x10000000
+
+struct imu_latest {
+	__u32 seq;		/* odd while the driver is updating sample */
+	__u32 reserved;
+	struct imu_sample sample;
+};
+
+#define IOCTL_READ_LATEST _IOR(MAJOR_NUM, 14, struct imu_sample)
+
+/*
+ * Scan mask: bit n selects channel n (enum imu_channel), and
+ * IMU_SCAN_ORIENTATION and IMU_SCAN_SEQ the virtual channels. Each open
+ * file picks the channels it wants, and read() then returns records
+ * holding the __u64 timestamp, the __u32 seq if selected, the selected
+ * channels as __u16 in channel order, then quat and euler if selected,
+ * zero padded to a multiple of 8 bytes. The default mask IMU_SCAN_ALL
+ * gives exactly struct imu_sample. Channels no open file selects are not
+ * acquired and read as 0 elsewhere; the mmap() ring always holds whole
+ * struct imu_sample records.
+ */
+#define IMU_SCAN_RAW ((1U << IMU_NUM_CHANNELS) - 1)
+#define IMU_SCAN_ORIENTATION (1U << IMU_CHAN_ORIENTATION)
+#define IMU_SCAN_SEQ (1U << IMU_CHAN_SEQ)
+#define IMU_SCAN_ALL (IMU_SCAN_RAW | IMU_SCAN_ORIENTATION | IMU_SCAN_SEQ)
+#define IMU_ORIENTATION_WORDS 7	/* quat[4] + euler[3] */
+#define IMU_SCAN_RECORD_SIZE(mask) \
+	(sizeof(__u64) + ((((mask) & IMU_SCAN_SEQ ? sizeof(__u32) : 0) + \
+	  2 * (__builtin_popcount((mask) & IMU_SCAN_RAW) + \
+	  ((mask) & IMU_SCAN_ORIENTATION ? IMU_ORIENTATION_WORDS : 0)) + 7) & ~7U))
+
+#define IOCTL_SET_SCAN_MASK _IOW(MAJOR_NUM, 15, __u32)
+
+/*
+ * Synthetic data sources. Both are reproducible: the same source, seed
+ * and sample rate always give the same stream, which restarts whenever
+ * IOCTL_SET_SOURCE is issued. Values are ADC counts in 0..1022.
+ *
+ * IMU_SOURCE_RANDOM	uniform noise on every channel
+ * IMU_SOURCE_WAVEFORM	per channel offset + amplitude * sin(2 pi f t)
+ *			+ uniform noise of +/- noise + drift counts per
+ *			1000 samples, see struct imu_waveform
+ */
+enum imu_source_id {
+	IMU_SOURCE_RANDOM = 0,
+	IMU_SOURCE_WAVEFORM,
+	IMU_NUM_SOURCES
+};
+
+struct imu_source_cfg {
+	__u32 source;		/* enum imu_source_id */
+	__u32 reserved;
+	__u64 seed;
+};
+
+struct imu_waveform {
+	__u32 channel;		/* enum imu_channel */
+	__u32 offset;		/* counts */
+	__u32 amplitude;	/* counts */
+	__u32 freq_mhz;		/* millihertz */
+	__u32 noise;		/* counts, peak */
+	__s32 drift;		/* counts per 1000 samples */
+};
+
+#define IOCTL_SET_SOURCE _IOW(MAJOR_NUM, 16, struct imu_source_cfg)
+#define IOCTL_SET_WAVEFORM _IOW(MAJOR_NUM, 17, struct imu_waveform)
+
+/*
+ * Trace replay. While a replay mode is set the synthetic source pauses
+ * and write() accepts whole struct imu_sample records, which are queued
+ * with their timestamps unchanged:
+ *
+ * IMU_REPLAY_ASAP	as fast as the ring accepts them
+ * IMU_REPLAY_TIMED	paced by their timestamps, speed times faster than
+ *			real time (1..1000), timed from the first record
+ *			written after the mode was set
+ *
+ * Every channel must hold an ADC count in 0..1022. write() queues the
+ * records before the first one that does not and then stops, returning
+ * the bytes queued, or -EINVAL if that record was the first.
+ */
+enum imu_replay_mode {
+	IMU_REPLAY_OFF = 0,
+	IMU_REPLAY_ASAP,
+	IMU_REPLAY_TIMED,
+	IMU_NUM_REPLAY_MODES
+};
+
+struct imu_replay_cfg {
+	__u32 mode;		/* enum imu_replay_mode */
+	__u32 speed;		/* IMU_REPLAY_TIMED only */
+};
+
+#define IOCTL_SET_REPLAY _IOW(MAJOR_NUM, 18, struct imu_replay_cfg)
+
+/*
+ * Stream description for read() consumers, the counterpart of the ring
+ * control page. record_size and scan_mask are those of the calling file;
+ * record_size is sizeof(struct imu_stats) in statistics mode.
+ */
+struct imu_info {
+	__u32 version;		/* IMU_RING_VERSION */
+	__u32 clock_id;		/* IMU_CLOCK_* of the records' timestamps */
+	__u32 sample_rate_hz;
+	__u32 source;		/* enum imu_source_id */
+	__u32 ring_size;	/* records */
+	__u32 record_size;	/* bytes per record returned by read() */
+	__u32 scan_mask;
+	__u32 decimation;	/* samples per emitted record */
+};
+
+#define IOCTL_GET_INFO _IOR(MAJOR_NUM, 19, struct imu_info)
+
+/*
+ * Filter stage between acquisition and the ring. Each channel has its own
+ * filter; all channels share one decimation factor, and only every
+ * decimation-th sample emits a record (stamped with the newest input's
+ * time), so readers see sample_rate_hz / decimation records per second.
+ *
+ * IMU_FILTER_NONE	plain decimation, param unused
+ * IMU_FILTER_MOVAVG	moving average of the last param (1..64) samples
+ * IMU_FILTER_CIC	CIC decimator of order param (1..4), differential
+ *			delay 1, gain-normalised
+ * IMU_FILTER_IIR	one-pole low-pass, y += (x - y) / 2^param (1..15)
+ *
+ * Setting a filter resets the state of every channel.
+ */
+enum imu_filter_type {
+	IMU_FILTER_NONE = 0,
+	IMU_FILTER_MOVAVG,
+	IMU_FILTER_CIC,
+	IMU_FILTER_IIR,
+	IMU_NUM_FILTERS
+};
+
+struct imu_filter_cfg {
+	__u32 channels;		/* scan mask of the channels to configure */
+	__u32 type;		/* enum imu_filter_type */
+	__u32 param;
+	__u32 decimation;	/* 1..256, applies to every channel */
+};
+
+#define IOCTL_SET_FILTER _IOW(MAJOR_NUM, 20, struct imu_filter_cfg)
+
+/*
+ * Fusion mode: an integer-only Mahony filter runs once per sample over
+ * the gyroscope, accelerometer and magnetometer and fills quat and euler.
+ * kp is the proportional gain (2Kp) in 1/65536 units, 0 for the default
+ * of 1.0. Enabling restarts from the identity orientation.
+ */
+struct imu_fusion_cfg {
+	__u32 enable;
+	__u32 kp;
+};
+
+#define IOCTL_SET_FUSION _IOW(MAJOR_NUM, 21, struct imu_fusion_cfg)
+
+/*
+ * Statistics mode: read() returns one struct imu_stats per window of
+ * window samples instead of the samples themselves, covering the raw
+ * channels in the file's scan mask (the others read as 0). window is at
+ * most ring_size; 0 goes back to plain records. Changing the window or
+ * the scan mask discards the partial window. Other files still see every
+ * sample.
+ */
+struct imu_stats_cfg {
+	__u32 window;
+	__u32 reserved;
+};
+
+#define IOCTL_SET_STATS _IOW(MAJOR_NUM, 22, struct imu_stats_cfg)
+
+struct imu_stats_channel {
+	__u16 min;
+	__u16 max;
+	__u32 mean;		/* 1/256 count */
+	__u64 variance;		/* population variance, 1/256 count^2 */
+};
+
+struct imu_stats {
+	__u64 first_ns;		/* timestamp of the window's first sample */
+	__u64 last_ns;		/* and of its last */
+	__u32 count;		/* samples in the window */
+	__u32 channels;		/* scan mask the statistics cover */
+	struct imu_stats_channel ch[IMU_NUM_CHANNELS];
+};
+
+/*
+ * Event detectors, evaluated on every record as it is produced. Each raw
+ * channel has at most one; all are edge-triggered and re-arm once the
+ * condition has cleared by hysteresis counts.
+ *
+ * IMU_EVENT_ABOVE	value rises above threshold
+ * IMU_EVENT_BELOW	value falls below threshold
+ * IMU_EVENT_SLOPE	value moves by threshold or more between two
+ *			consecutive records, either way
+ *
+ * A detector that could never re-arm is refused with -EINVAL: hysteresis
+ * may be at most threshold for IMU_EVENT_ABOVE, at most 1022 - threshold
+ * for IMU_EVENT_BELOW, and must be below threshold for IMU_EVENT_SLOPE.
+ *
+ * Events go to a queue shared by all files, each with its own cursor
+ * starting at open(). poll() reports EPOLLPRI while this file has events
+ * queued; IOCTL_READ_EVENT returns the oldest, blocking unless the file
+ * is O_NONBLOCK. A file that falls a whole queue behind loses the oldest
+ * events, counted in the lost field of the next one it reads.
+ */
+enum imu_event_type {
+	IMU_EVENT_NONE,
+	IMU_EVENT_ABOVE,
+	IMU_EVENT_BELOW,
+	IMU_EVENT_SLOPE,
+	IMU_NUM_EVENTS
+};
+
+struct imu_event_cfg {
+	__u32 channel;		/* enum imu_channel */
+	__u32 type;		/* enum imu_event_type, NONE to remove */
+	__u16 threshold;
+	__u16 hysteresis;
+	__u32 reserved;
+};
+
+struct imu_event {
+	__u64 timestamp_ns;	/* of the record that fired it */
+	__u16 channel;
+	__u16 type;
+	__u16 value;		/* channel value in that record */
+	__u16 lost;		/* events skipped before this one, saturating */
+};
+
+#define IOCTL_SET_EVENT _IOW(MAJOR_NUM, 23, struct imu_event_cfg)
+#define IOCTL_READ_EVENT _IOR(MAJOR_NUM, 24, struct imu_event)
+
+/*
+ * What a file that falls a whole ring behind costs the others.
+ *
+ * IMU_OVERRUN_DROP	 new samples are dropped, for every file, until it
+ *			 catches up
+ * IMU_OVERRUN_OVERWRITE the producer goes on without it and this file
+ *			 loses its oldest unread samples instead (the default)
+ * IMU_OVERRUN_BLOCK	 the producer waits for it: acquisition pauses, and
+ *			 a replay write() sleeps, until there is room again,
+ *			 so no sample is lost but the stream has a time gap
+ *
+ * A file that has the ring mapped cannot use IMU_OVERRUN_OVERWRITE, so
+ * it must choose one of the others before mmap().
+ * Leaving IMU_OVERRUN_OVERWRITE discards the file's backlog. Either way
+ * the seq of the records read shows which were missed.
+ */
+enum imu_overrun_policy {
+	IMU_OVERRUN_DROP,
+	IMU_OVERRUN_OVERWRITE,
+	IMU_OVERRUN_BLOCK,
+	IMU_NUM_OVERRUN_POLICIES
+};
+
+#define IOCTL_SET_OVERRUN _IOW(MAJOR_NUM, 25, __u32)
+
+/* Samples this file missed since it was opened */
+struct imu_overruns {
+	__u64 dropped;		/* never queued: the ring was full */
+	__u64 overwritten;	/* overwritten before this file read them */
+	__u64 blocked;		/* sample periods acquisition was paused */
+};
+
+#define IOCTL_GET_OVERRUNS _IOR(MAJOR_NUM, 26, struct imu_overruns)
+
+/*
+ * Record encoding for read(), chosen per open file. The scan mask picks
+ * the fields in every encoding; statistics mode ignores the encoding.
+ *
+ * IMU_FORMAT_PACKED16	the scan layout above (the default)
+ * IMU_FORMAT_S32	the same fields, but each channel, quat and euler
+ *			value widened to a __s32 (quat and euler are
+ *			sign-extended), zero padded to a multiple of 8
+ *			bytes, see IMU_S32_RECORD_SIZE
+ * IMU_FORMAT_DELTA	each field as the difference from the same field
+ *			in the previous record this file read, zigzag
+ *			encoded and written as a LEB128 varint: the
+ *			timestamp, seq if selected, then the words in scan
+ *			order. Records are not padded, so their length
+ *			varies up to IMU_DELTA_RECORD_MAX; the first record
+ *			after open() or IOCTL_SET_FORMAT or
+ *			IOCTL_SET_SCAN_MASK is coded against all zeroes.
+ *			A slowly varying channel costs one byte.
+ *
+ * In IMU_FORMAT_DELTA read() needs room for IMU_DELTA_RECORD_MAX bytes
+ * and returns whole records until less than that is left; record_size
+ * in struct imu_info is that bound. A varint holds 7 bits per byte, low
+ * bits first, with the top bit set on every byte but the last; zigzag
+ * maps 0, -1, 1, -2 ... to 0, 1, 2, 3 ...
+ */
+enum imu_format {
+	IMU_FORMAT_PACKED16,
+	IMU_FORMAT_S32,
+	IMU_FORMAT_DELTA,
+	IMU_NUM_FORMATS
+};
+
+#define IMU_SCAN_WORDS(mask) \
+	(__builtin_popcount((mask) & IMU_SCAN_RAW) + \
+	 ((mask) & IMU_SCAN_ORIENTATION ? IMU_ORIENTATION_WORDS : 0))
+#define IMU_S32_RECORD_SIZE(mask) \
+	(sizeof(__u64) + ((((mask) & IMU_SCAN_SEQ ? sizeof(__u32) : 0) + \
+	  4 * IMU_SCAN_WORDS(mask) + 7) & ~7U))
+#define IMU_DELTA_RECORD_MAX(mask) \
+	(10 + ((mask) & IMU_SCAN_SEQ ? 5 : 0) + 3 * IMU_SCAN_WORDS(mask))
+
+#define IOCTL_SET_FORMAT _IOW(MAJOR_NUM, 27, __u32)
+
+#define DEVICE_FILE_NAME "/dev/imu_char0"	/* first instance; see num_devices */
 
 #endif
 
@@ -0,0 +1,168 @@
+/*
+ * Tracepoints for imu_char. They cost a patched-out branch while
+ * disabled; enable them with perf or through tracefs, e.g.
+ *
+ *	perf record -e 'imu_char:*' -a
+ *	echo 1 > /sys/kernel/tracing/events/imu_char/enable
+ *
+ * Samples move in batches, so every event covers n consecutive records.
+ * id is the instance (the N in /dev/imu_charN); reader identifies an
+ * open file.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM imu_char
+
+#if !defined(IMU_CHAR_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define IMU_CHAR_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#ifndef IMU_CHAR_TRACE_ONCE
+#define IMU_CHAR_TRACE_ONCE
+enum imu_drop_reason {
+	IMU_DROP_FULL,		/* no room in the ring */
+	IMU_DROP_STALL,		/* the timer fell more than a ring behind */
+};
+#endif
+
+TRACE_DEFINE_ENUM(IMU_DROP_FULL);
+TRACE_DEFINE_ENUM(IMU_DROP_STALL);
+
+DECLARE_EVENT_CLASS(imu_char_file,
+	TP_PROTO(unsigned int id, const void *reader),
+	TP_ARGS(id, reader),
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(const void *, reader)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->reader = reader;
+	),
+	TP_printk("dev=%u reader=%p", __entry->id, __entry->reader)
+);
+
+DEFINE_EVENT(imu_char_file, imu_char_open,
+	TP_PROTO(unsigned int id, const void *reader),
+	TP_ARGS(id, reader));
+
+DEFINE_EVENT(imu_char_file, imu_char_release,
+	TP_PROTO(unsigned int id, const void *reader),
+	TP_ARGS(id, reader));
+
+/* The synthetic source generated samples index .. index + n - 1 */
+TRACE_EVENT(imu_char_acquire,
+	TP_PROTO(unsigned int id, u64 index, unsigned int n, u64 first_ns),
+	TP_ARGS(id, index, n, first_ns),
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(unsigned int, n)
+		__field(u64, index)
+		__field(u64, first_ns)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->n = n;
+		__entry->index = index;
+		__entry->first_ns = first_ns;
+	),
+	TP_printk("dev=%u index=%llu n=%u ts=%llu", __entry->id,
+		  __entry->index, __entry->n, __entry->first_ns)
+);
+
+/* Records seq .. seq + n - 1 were queued, the ring head is now head */
+TRACE_EVENT(imu_char_enqueue,
+	TP_PROTO(unsigned int id, u32 seq, unsigned int n, u64 head),
+	TP_ARGS(id, seq, n, head),
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(u32, seq)
+		__field(unsigned int, n)
+		__field(u64, head)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->seq = seq;
+		__entry->n = n;
+		__entry->head = head;
+	),
+	TP_printk("dev=%u seq=%u n=%u head=%llu", __entry->id, __entry->seq,
+		  __entry->n, __entry->head)
+);
+
+/*
+ * A reader took n records from ring position tail and returned bytes
+ * bytes; in statistics mode the summary follows later, so bytes is 0
+ */
+TRACE_EVENT(imu_char_dequeue,
+	TP_PROTO(unsigned int id, const void *reader, u64 tail, unsigned int n,
+		 size_t bytes),
+	TP_ARGS(id, reader, tail, n, bytes),
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(const void *, reader)
+		__field(u64, tail)
+		__field(unsigned int, n)
+		__field(size_t, bytes)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->reader = reader;
+		__entry->tail = tail;
+		__entry->n = n;
+		__entry->bytes = bytes;
+	),
+	TP_printk("dev=%u reader=%p tail=%llu n=%u bytes=%zu", __entry->id,
+		  __entry->reader, __entry->tail, __entry->n, __entry->bytes)
+);
+
+/* Records seq .. seq + n - 1 were numbered but never queued */
+TRACE_EVENT(imu_char_drop,
+	TP_PROTO(unsigned int id, u32 seq, unsigned int n, int reason),
+	TP_ARGS(id, seq, n, reason),
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(u32, seq)
+		__field(unsigned int, n)
+		__field(int, reason)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->seq = seq;
+		__entry->n = n;
+		__entry->reason = reason;
+	),
+	TP_printk("dev=%u seq=%u n=%u reason=%s", __entry->id, __entry->seq,
+		  __entry->n, __print_symbolic(__entry->reason,
+			{ IMU_DROP_FULL, "full" },
+			{ IMU_DROP_STALL, "stall" }))
+);
+
+/* An IMU_OVERRUN_OVERWRITE reader lost n records from ring position tail */
+TRACE_EVENT(imu_char_overwrite,
+	TP_PROTO(unsigned int id, const void *reader, u64 tail, u64 n),
+	TP_ARGS(id, reader, tail, n),
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(const void *, reader)
+		__field(u64, tail)
+		__field(u64, n)
+	),
+	TP_fast_assign(
+		__entry->id = id;
+		__entry->reader = reader;
+		__entry->tail = tail;
+		__entry->n = n;
+	),
+	TP_printk("dev=%u reader=%p tail=%llu n=%llu", __entry->id,
+		  __entry->reader, __entry->tail, __entry->n)
+);
+
+#endif /* IMU_CHAR_TRACE_H */
+
+/* the header is in the module's directory, see CFLAGS_main.o */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE imu_char_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,302 @@
+/*
+ * libimu: userspace client for imu_char, see libimu.h.
+ */
+#include "libimu.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#define IMU_BUF_MAX (64 * 1024)	/* bounce buffer for packed records */
+
+struct imu_client {
+	int fd;
+	unsigned int flags;		/* IMU_OPEN_* */
+	uint32_t scan_mask;
+	size_t record_size;		/* IMU_SCAN_RECORD_SIZE(scan_mask) */
+	struct imu_ring_ctrl *ctrl;	/* NULL until imu_map() */
+	const struct imu_sample *data;
+	size_t map_size;
+	uint64_t head;			/* ring iteration, see imu_ring_begin() */
+	uint64_t pos;
+	struct imu_sample last;		/* newest sample this client read */
+	unsigned char *buf;		/* packed records, IMU_BUF_MAX bytes */
+};
+
+/* The driver returns a positive value on success */
+static int imu_ioctl(struct imu_client *c, unsigned long req, void *arg)
+{
+	return ioctl(c->fd, req, arg) < 0 ? -1 : 0;
+}
+
+/* Expand one record of the given scan layout into a struct imu_sample */
+static void imu_unpack(const unsigned char *p, uint32_t mask,
+		       struct imu_sample *s)
+{
+	int ch;
+
+	memset(s, 0, sizeof(*s));
+	memcpy(&s->timestamp_ns, p, sizeof(s->timestamp_ns));
+	p += sizeof(s->timestamp_ns);
+	if (mask & IMU_SCAN_SEQ) {
+		memcpy(&s->seq, p, sizeof(s->seq));
+		p += sizeof(s->seq);
+	}
+	for (ch = 0; ch < IMU_NUM_CHANNELS; ch++) {
+		if (mask & (1U << ch)) {
+			memcpy(&s->channel[ch], p, sizeof(s->channel[ch]));
+			p += sizeof(s->channel[ch]);
+		}
+	}
+	if (mask & IMU_SCAN_ORIENTATION) {
+		memcpy(s->quat, p, sizeof(s->quat));
+		p += sizeof(s->quat);
+		memcpy(s->euler, p, sizeof(s->euler));
+	}
+}
+
+struct imu_client *imu_open(const char *path, unsigned int flags)
+{
+	int oflags = O_CLOEXEC | (flags & IMU_OPEN_NONBLOCK ? O_NONBLOCK : 0);
+	struct imu_client *c;
+
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return NULL;
+	if (!path)
+		path = DEVICE_FILE_NAME;
+
+	/* the ring mapping is writable, for data_tail */
+	c->fd = open(path, O_RDWR | oflags);
+	if (c->fd < 0 && errno == EACCES)
+		c->fd = open(path, O_RDONLY | oflags);
+	if (c->fd < 0) {
+		free(c);
+		return NULL;
+	}
+	c->flags = flags;
+	c->scan_mask = IMU_SCAN_ALL;
+	c->record_size = sizeof(struct imu_sample);
+	return c;
+}
+
+void imu_close(struct imu_client *c)
+{
+	int err = errno;
+
+	if (!c)
+		return;
+	if (c->ctrl)
+		munmap(c->ctrl, c->map_size);
+	close(c->fd);
+	free(c->buf);
+	free(c);
+	errno = err;
+}
+
+int imu_fd(const struct imu_client *c)
+{
+	return c->fd;
+}
+
+int imu_set_rate(struct imu_client *c, unsigned int hz)
+{
+	__u32 val = hz;
+
+	return imu_ioctl(c, IOCTL_SET_SAMPLE_RATE, &val);
+}
+
+int imu_set_channels(struct imu_client *c, uint32_t scan_mask)
+{
+	__u32 val = scan_mask;
+
+	if (imu_ioctl(c, IOCTL_SET_SCAN_MASK, &val))
+		return -1;
+	c->scan_mask = scan_mask;
+	c->record_size = IMU_SCAN_RECORD_SIZE(scan_mask);
+	return 0;
+}
+
+int imu_set_watermark(struct imu_client *c, unsigned int samples)
+{
+	__u32 val = samples;
+
+	return imu_ioctl(c, IOCTL_SET_WATERMARK, &val);
+}
+
+int imu_get_info(struct imu_client *c, struct imu_info *info)
+{
+	return imu_ioctl(c, IOCTL_GET_INFO, info);
+}
+
+int imu_map(struct imu_client *c)
+{
+	struct imu_info info;
+	long page = sysconf(_SC_PAGESIZE);
+	__u32 policy = IMU_OVERRUN_DROP;
+	size_t size;
+	void *p;
+
+	if (c->ctrl)
+		return 0;
+	if (imu_get_info(c, &info))
+		return -1;
+	/* a mapping cannot be lapped, see IOCTL_SET_OVERRUN */
+	if (imu_ioctl(c, IOCTL_SET_OVERRUN, &policy))
+		return -1;
+	size = info.ring_size * sizeof(struct imu_sample);
+	size = page + ((size + page - 1) & ~(size_t)(page - 1));
+
+	p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+	if (p == MAP_FAILED) {
+		int err = errno;
+
+		policy = IMU_OVERRUN_OVERWRITE;
+		imu_ioctl(c, IOCTL_SET_OVERRUN, &policy);
+		errno = err;
+		return -1;
+	}
+	c->ctrl = p;
+	c->data = (const void *)((char *)p + c->ctrl->data_offset);
+	c->map_size = size;
+	c->head = c->pos = c->ctrl->data_tail;
+	return 0;
+}
+
+size_t imu_ring_begin(struct imu_client *c)
+{
+	uint64_t tail;
+
+	if (!c->ctrl)
+		return 0;
+	tail = c->ctrl->data_tail;
+	c->head = __atomic_load_n(&c->ctrl->data_head, __ATOMIC_ACQUIRE);
+	c->pos = tail;
+	return c->head - tail;
+}
+
+const struct imu_sample *imu_ring_next(struct imu_client *c)
+{
+	if (!c->ctrl || c->pos == c->head)
+		return NULL;
+	return &c->data[c->pos++ & (c->ctrl->data_size - 1)];
+}
+
+void imu_ring_end(struct imu_client *c)
+{
+	if (!c->ctrl || c->pos == c->ctrl->data_tail)
+		return;
+	c->last = c->data[(c->pos - 1) & (c->ctrl->data_size - 1)];
+	__atomic_store_n(&c->ctrl->data_tail, c->pos, __ATOMIC_RELEASE);
+}
+
+int imu_wait(struct imu_client *c)
+{
+	return imu_ioctl(c, IOCTL_WAIT_SAMPLES, NULL);
+}
+
+/* Copy up to n queued samples out of the mapped ring */
+static ssize_t imu_read_ring(struct imu_client *c, struct imu_sample *s,
+			     size_t n)
+{
+	size_t avail, first, mask = c->ctrl->data_size - 1;
+
+	while (!(avail = imu_ring_begin(c))) {
+		if (c->flags & IMU_OPEN_NONBLOCK) {
+			errno = EAGAIN;
+			return -1;
+		}
+		if (imu_wait(c))
+			return -1;
+	}
+	if (n > avail)
+		n = avail;
+
+	/* the records may wrap around the end of the ring */
+	first = mask + 1 - (c->pos & mask);
+	if (first > n)
+		first = n;
+	memcpy(s, &c->data[c->pos & mask], first * sizeof(*s));
+	memcpy(s + first, c->data, (n - first) * sizeof(*s));
+	c->pos += n;
+	imu_ring_end(c);
+	return n;
+}
+
+ssize_t imu_read_samples(struct imu_client *c, struct imu_sample *s, size_t n)
+{
+	size_t i, rec = c->record_size;
+	ssize_t ret;
+
+	if (!n)
+		return 0;
+	if (c->ctrl)
+		return imu_read_ring(c, s, n);
+
+	if (c->scan_mask == IMU_SCAN_ALL) {
+		ret = read(c->fd, s, n * sizeof(*s));
+		if (ret <= 0)
+			return ret;
+		ret /= sizeof(*s);
+		c->last = s[ret - 1];
+		return ret;
+	}
+
+	/* a reduced layout is read packed and expanded */
+	if (!c->buf) {
+		c->buf = malloc(IMU_BUF_MAX);
+		if (!c->buf)
+			return -1;
+	}
+	if (n > IMU_BUF_MAX / rec)
+		n = IMU_BUF_MAX / rec;
+	ret = read(c->fd, c->buf, n * rec);
+	if (ret <= 0)
+		return ret;
+	ret /= rec;
+	for (i = 0; i < (size_t)ret; i++)
+		imu_unpack(c->buf + i * rec, c->scan_mask, &s[i]);
+	c->last = s[ret - 1];
+	return ret;
+}
+
+ssize_t imu_read_records(struct imu_client *c, void *buf, size_t n)
+{
+	ssize_t ret;
+
+	if (!n)
+		return 0;
+	ret = read(c->fd, buf, n * c->record_size);
+	if (ret <= 0)
+		return ret;
+	ret /= c->record_size;
+	imu_unpack((unsigned char *)buf + (ret - 1) * c->record_size,
+		   c->scan_mask, &c->last);
+	return ret;
+}
+
+int imu_read_latest(struct imu_client *c, struct imu_sample *s)
+{
+	return imu_ioctl(c, IOCTL_READ_LATEST, s);
+}
+
+int imu_read_all(struct imu_client *c, struct imu_sample *s)
+{
+	return imu_ioctl(c, IOCTL_READ_ALL_CHANNELS, s);
+}
+
+int imu_read_channel(struct imu_client *c, enum imu_channel ch,
+		     uint16_t *value)
+{
+	if ((unsigned int)ch >= IMU_NUM_CHANNELS) {
+		errno = EINVAL;
+		return -1;
+	}
+	/* kept by the read functions, so no ioctl is needed */
+	*value = c->last.channel[ch];
+	return 0;
+}
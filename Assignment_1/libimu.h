@@ -0,0 +1,91 @@
+#ifndef LIBIMU_H
+#define LIBIMU_H
+
+/*
+ * libimu: userspace client for imu_char. One struct imu_client wraps one
+ * open file, so each has its own cursor, scan mask and watermark.
+ *
+ *	struct imu_client *c = imu_open(NULL, 0);
+ *	struct imu_sample buf[256];
+ *	ssize_t n;
+ *
+ *	imu_set_rate(c, 1000);
+ *	imu_set_watermark(c, 64);
+ *	imu_map(c);			(optional, may fail with EBUSY)
+ *	while ((n = imu_read_samples(c, buf, 256)) > 0)
+ *		consume(buf, n);
+ *	imu_close(c);
+ *
+ * imu_read_samples() takes records from the mapped ring when the client
+ * has it mapped, costing no syscall while records are queued, and
+ * otherwise with one read() per batch. Functions returning int give 0
+ * on success and -1 with errno set on failure; NULL likewise sets errno.
+ */
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "chardev.h"
+
+struct imu_client;
+
+#define IMU_OPEN_NONBLOCK 0x1	/* reads fail with EAGAIN instead of waiting */
+
+/* path NULL opens DEVICE_FILE_NAME */
+struct imu_client *imu_open(const char *path, unsigned int flags);
+void imu_close(struct imu_client *c);
+
+/* For poll(): POLLIN once the watermark is met, POLLPRI on events */
+int imu_fd(const struct imu_client *c);
+
+int imu_set_rate(struct imu_client *c, unsigned int hz);
+int imu_set_channels(struct imu_client *c, uint32_t scan_mask);
+int imu_set_watermark(struct imu_client *c, unsigned int samples);
+int imu_get_info(struct imu_client *c, struct imu_info *info);
+
+/*
+ * Map the sample ring so that reads need no copy through the kernel.
+ * Only one file at a time may map it; others get EBUSY and go on
+ * reading with read(). The client is switched to IMU_OVERRUN_DROP first,
+ * since a mapped file cannot be lapped, which discards what it had
+ * queued; it is back to the default policy if the mapping fails.
+ */
+int imu_map(struct imu_client *c);
+
+/*
+ * Up to n samples, oldest first, as whole struct imu_sample records
+ * whatever the scan mask (unselected channels read as 0). Waits for the
+ * watermark unless opened IMU_OPEN_NONBLOCK. Returns the number of
+ * samples, or -1.
+ */
+ssize_t imu_read_samples(struct imu_client *c, struct imu_sample *s, size_t n);
+
+/*
+ * Up to n records in the file's own layout, IMU_SCAN_RECORD_SIZE() of
+ * the scan mask each, straight from read(). Returns the number of
+ * records, or -1.
+ */
+ssize_t imu_read_records(struct imu_client *c, void *buf, size_t n);
+
+/*
+ * Iterate the mapped ring in place: imu_ring_begin() returns how many
+ * records are queued, imu_ring_next() each of them in turn and NULL at
+ * the end, and imu_ring_end() hands the slots back to the driver.
+ * Records are only valid until imu_ring_end().
+ */
+size_t imu_ring_begin(struct imu_client *c);
+const struct imu_sample *imu_ring_next(struct imu_client *c);
+void imu_ring_end(struct imu_client *c);
+
+/* Sleep until the watermark is met */
+int imu_wait(struct imu_client *c);
+
+/* Newest sample, with no history; all channels in one ioctl */
+int imu_read_latest(struct imu_client *c, struct imu_sample *s);
+int imu_read_all(struct imu_client *c, struct imu_sample *s);
+
+/* The channel's value in the last record this client read */
+int imu_read_channel(struct imu_client *c, enum imu_channel ch,
+		     uint16_t *value);
+
+#endif
@@ -0,0 +1,495 @@
+/*
+ * loadgen: concurrent load on imu_char. N workers, threads or processes,
+ * each pinned to a CPU, hammer one instance with read() or ioctl() for a
+ * fixed time and check every record they get:
+ *
+ *	torn		a record mixed from two samples: its timestamp
+ *			does not match its seq, the timer's records being
+ *			exactly one sample period apart, or a value is out
+ *			of range or the reserved field is not zero
+ *	backwards	seq or the timestamp went back, so a record was seen
+ *			twice or out of order
+ *	gaps		records skipped by seq; expected when the ring
+ *			overruns, see IOCTL_GET_OVERRUNS
+ *	mismatched	(-m mix, own files only) a per-channel ioctl did not
+ *			return the channel from the last record this file
+ *			read
+ *
+ * Workers open a file each, or with -s all share one, which puts them
+ * behind the same per-file lock. The report ends with Jain's fairness
+ * index of the workers' throughput: 1 when all got the same share, 1/N
+ * when one got everything.
+ */
+#define _GNU_SOURCE
+#include "libimu.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define LG_BATCH 64
+#define LG_ADC_MAX 1022		/* values are ADC counts in 0..1022 */
+#define LG_POLL_MS 100		/* recheck the deadline while idle */
+
+enum lg_method { LG_READ, LG_LATEST, LG_MIX, LG_NUM_METHODS };
+
+static const char *const method_names[LG_NUM_METHODS] = {
+	"read", "latest", "mix",
+};
+
+static const char *const policy_names[IMU_NUM_OVERRUN_POLICIES] = {
+	"drop", "overwrite", "block",
+};
+
+/* The per-channel ioctls, indexed by enum imu_channel */
+static const unsigned long chan_ioctl[IMU_NUM_CHANNELS] = {
+	IOCTL_GYROSCOPE_X_AXIS, IOCTL_GYROSCOPE_Y_AXIS, IOCTL_GYROSCOPE_Z_AXIS,
+	IOCTL_ACCELEROMETER_X_AXIS, IOCTL_ACCELEROMETER_Y_AXIS,
+	IOCTL_ACCELEROMETER_Z_AXIS, IOCTL_MAGNETOMETER_X_AXIS,
+	IOCTL_MAGNETOMETER_Y_AXIS, IOCTL_MAGNETOMETER_Z_AXIS,
+	IOCTL_BAROMETER_PRESSURE,
+};
+
+struct lg_cfg {
+	const char *path;
+	unsigned int workers;
+	int procs;		/* fork() rather than pthread_create() */
+	int shared;		/* one open file for everybody */
+	int pin;
+	double duration;	/* seconds */
+	unsigned int batch;
+	unsigned int rate;	/* Hz, 0 leaves the driver's */
+	int policy;		/* enum imu_overrun_policy, -1 leaves it */
+	enum lg_method method;
+	uint64_t period_ns;	/* timestamp step per seq, 0 if not checked */
+};
+
+/* Results live in shared memory so that forked workers can fill them */
+struct lg_worker {
+	const struct lg_cfg *cfg;
+	struct imu_client *c;	/* NULL until the worker opens its own */
+	pthread_t tid;
+	unsigned int id;
+	int cpu;
+	uint64_t records;
+	uint64_t calls;
+	uint64_t gaps;
+	uint64_t backwards;
+	uint64_t torn;
+	uint64_t mismatched;
+	int err;		/* errno that ended the run early */
+	/* checker state */
+	int have_prev;
+	uint32_t prev_seq;
+	uint64_t prev_ts;
+} __attribute__((aligned(64)));
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/*
+ * Check one record against the previous one this worker saw. Repeats
+ * are allowed for IOCTL_READ_LATEST, which returns the same sample until
+ * a newer one is published. A torn record is not kept as the previous
+ * one, so it is counted once.
+ */
+static void lg_check(struct lg_worker *w, const struct imu_sample *s,
+		     int repeats_ok)
+{
+	uint64_t period = w->cfg->period_ns, step;
+	int32_t d;
+	int ch;
+
+	for (ch = 0; ch < IMU_NUM_CHANNELS; ch++)
+		if (s->channel[ch] > LG_ADC_MAX)
+			break;
+	if (ch < IMU_NUM_CHANNELS || s->reserved) {
+		w->torn++;
+		return;
+	}
+
+	if (w->have_prev) {
+		d = (int32_t)(s->seq - w->prev_seq);
+		step = s->timestamp_ns - w->prev_ts;
+		if (d < 0 || (!d && !repeats_ok) || (int64_t)step < 0) {
+			w->backwards++;
+		} else if (period && step != (uint64_t)d * period) {
+			w->torn++;
+			return;
+		} else if (d > 1 && !repeats_ok) {
+			w->gaps += d - 1;
+		}
+	}
+	w->have_prev = 1;
+	w->prev_seq = s->seq;
+	w->prev_ts = s->timestamp_ns;
+}
+
+/* Sleep until records are queued or the poll interval is up */
+static void lg_idle(int fd)
+{
+	struct pollfd pfd = { .fd = fd, .events = POLLIN };
+
+	poll(&pfd, 1, LG_POLL_MS);
+}
+
+static void lg_run(struct lg_worker *w, int fd)
+{
+	const struct lg_cfg *cfg = w->cfg;
+	uint64_t deadline = now_ns() + cfg->duration * 1e9;
+	struct imu_sample *buf, latest;
+	unsigned int ch = 0;
+	uint16_t value;
+	ssize_t n, i;
+	int verify = cfg->method == LG_MIX && !cfg->shared;
+
+	buf = calloc(cfg->batch, sizeof(*buf));
+	if (!buf) {
+		w->err = errno;
+		return;
+	}
+
+	while (now_ns() < deadline) {
+		if (cfg->method == LG_LATEST) {
+			w->calls++;
+			if (ioctl(fd, IOCTL_READ_LATEST, &latest) < 0) {
+				w->err = errno;
+				break;
+			}
+			w->records++;
+			lg_check(w, &latest, 1);
+			continue;
+		}
+
+		w->calls++;
+		n = read(fd, buf, cfg->batch * sizeof(*buf));
+		if (n < 0) {
+			if (errno == EAGAIN) {
+				lg_idle(fd);
+				continue;
+			}
+			if (errno == EINTR)
+				continue;
+			w->err = errno;
+			break;
+		}
+		n /= sizeof(*buf);
+		w->records += n;
+		for (i = 0; i < n; i++)
+			lg_check(w, &buf[i], 0);
+
+		if (cfg->method != LG_MIX || !n)
+			continue;
+		/* channel ch of the newest record the file read, in turn */
+		w->calls++;
+		if (ioctl(fd, chan_ioctl[ch], &value) < 0) {
+			w->err = errno;
+			break;
+		}
+		if (verify && value != buf[n - 1].channel[ch])
+			w->mismatched++;
+		ch = (ch + 1) % IMU_NUM_CHANNELS;
+	}
+	free(buf);
+}
+
+/* Open and configure a file for one worker, or the shared one */
+static struct imu_client *lg_open(const struct lg_cfg *cfg)
+{
+	struct imu_client *c;
+	__u32 policy;
+
+	c = imu_open(cfg->path, IMU_OPEN_NONBLOCK);
+	if (!c)
+		return NULL;
+	if (cfg->policy >= 0) {
+		policy = cfg->policy;
+		if (ioctl(imu_fd(c), IOCTL_SET_OVERRUN, &policy) < 0) {
+			imu_close(c);
+			return NULL;
+		}
+	}
+	return c;
+}
+
+static void *lg_worker_main(void *arg)
+{
+	struct lg_worker *w = arg;
+	const struct lg_cfg *cfg = w->cfg;
+	struct imu_client *c = w->c;
+	cpu_set_t set;
+
+	if (cfg->pin) {
+		CPU_ZERO(&set);
+		CPU_SET(w->cpu, &set);
+		/* 0 is the calling thread, whether thread or process */
+		if (sched_setaffinity(0, sizeof(set), &set) < 0)
+			w->cpu = -1;
+	}
+	if (!c) {
+		c = lg_open(cfg);
+		if (!c) {
+			w->err = errno;
+			return NULL;
+		}
+	}
+	lg_run(w, imu_fd(c));
+	if (!w->c)
+		imu_close(c);
+	return NULL;
+}
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-n workers] [-p] [-s] [-P] [-m method] [-d seconds]\n"
+		"          [-b batch] [-r rate] [-o policy] [-D device]\n"
+		"  -n  workers (default 4)\n"
+		"  -p  workers are processes instead of threads\n"
+		"  -s  all workers share one open file\n"
+		"  -P  do not pin worker i to CPU i\n"
+		"  -m  read, latest (IOCTL_READ_LATEST) or mix (read plus the\n"
+		"      per-channel ioctls, checked) (default read)\n"
+		"  -d  run time in seconds (default 5)\n"
+		"  -b  records per read() (default %d)\n"
+		"  -r  sample rate in Hz (default: leave the driver's)\n"
+		"  -o  overrun policy: drop, overwrite or block\n"
+		"  -D  device node (default " DEVICE_FILE_NAME ")\n"
+		"Records count as torn if their timestamps do not step by one\n"
+		"sample period per seq. That check is off with -o block, a\n"
+		"decimating filter or replay, and misfires if another file\n"
+		"changes the rate, replays or pauses the stream with\n"
+		"IMU_OVERRUN_BLOCK during the run.\n",
+		prog, LG_BATCH);
+}
+
+static int lg_parse(int argc, char **argv, struct lg_cfg *cfg)
+{
+	char *end;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "n:psPm:d:b:r:o:D:h")) != -1) {
+		errno = 0;
+		switch (opt) {
+		case 'n':
+			cfg->workers = strtoul(optarg, &end, 0);
+			if (*end || errno || !cfg->workers)
+				return -1;
+			break;
+		case 'p':
+			cfg->procs = 1;
+			break;
+		case 's':
+			cfg->shared = 1;
+			break;
+		case 'P':
+			cfg->pin = 0;
+			break;
+		case 'm':
+			for (i = 0; i < LG_NUM_METHODS; i++)
+				if (!strcmp(optarg, method_names[i]))
+					break;
+			if (i == LG_NUM_METHODS)
+				return -1;
+			cfg->method = i;
+			break;
+		case 'd':
+			cfg->duration = strtod(optarg, &end);
+			if (*end || errno || cfg->duration <= 0)
+				return -1;
+			break;
+		case 'b':
+			cfg->batch = strtoul(optarg, &end, 0);
+			if (*end || errno || !cfg->batch)
+				return -1;
+			break;
+		case 'r':
+			cfg->rate = strtoul(optarg, &end, 0);
+			if (*end || errno || !cfg->rate)
+				return -1;
+			break;
+		case 'o':
+			for (i = 0; i < IMU_NUM_OVERRUN_POLICIES; i++)
+				if (!strcmp(optarg, policy_names[i]))
+					break;
+			if (i == IMU_NUM_OVERRUN_POLICIES)
+				return -1;
+			cfg->policy = i;
+			break;
+		case 'D':
+			cfg->path = optarg;
+			break;
+		default:
+			return -1;
+		}
+	}
+	return optind == argc ? 0 : -1;
+}
+
+static void lg_report(const struct lg_cfg *cfg, const struct lg_worker *w,
+		      double secs)
+{
+	uint64_t records = 0, calls = 0, gaps = 0, backwards = 0, torn = 0;
+	uint64_t mismatched = 0, min = UINT64_MAX, max = 0;
+	double sum = 0, sumsq = 0, x;
+	unsigned int i;
+
+	printf("%u %s, %s file%s, method %s, batch %u, %.2f s\n",
+	       cfg->workers, cfg->procs ? "processes" : "threads",
+	       cfg->shared ? "one shared" : "own", cfg->shared ? "" : "s",
+	       method_names[cfg->method], cfg->batch, secs);
+	if (!cfg->period_ns)
+		printf("timestamp check off, torn counts only bad values\n");
+	printf("%6s %4s %12s %12s %12s %10s %10s %8s %10s\n", "worker", "cpu",
+	       "records", "records/s", "calls", "gaps", "backwards", "torn",
+	       "mismatched");
+	for (i = 0; i < cfg->workers; i++) {
+		printf("%6u %4d %12llu %12.0f %12llu %10llu %10llu %8llu %10llu",
+		       w[i].id, w[i].cpu, (unsigned long long)w[i].records,
+		       w[i].records / secs, (unsigned long long)w[i].calls,
+		       (unsigned long long)w[i].gaps,
+		       (unsigned long long)w[i].backwards,
+		       (unsigned long long)w[i].torn,
+		       (unsigned long long)w[i].mismatched);
+		if (w[i].err)
+			printf("  %s", strerror(w[i].err));
+		printf("\n");
+
+		records += w[i].records;
+		calls += w[i].calls;
+		gaps += w[i].gaps;
+		backwards += w[i].backwards;
+		torn += w[i].torn;
+		mismatched += w[i].mismatched;
+		if (w[i].records < min)
+			min = w[i].records;
+		if (w[i].records > max)
+			max = w[i].records;
+		x = w[i].records;
+		sum += x;
+		sumsq += x * x;
+	}
+	printf("%6s %4s %12llu %12.0f %12llu %10llu %10llu %8llu %10llu\n",
+	       "total", "", (unsigned long long)records, records / secs,
+	       (unsigned long long)calls, (unsigned long long)gaps,
+	       (unsigned long long)backwards, (unsigned long long)torn,
+	       (unsigned long long)mismatched);
+	printf("fairness %.4f (Jain), min/max records %.4f\n",
+	       sumsq ? sum * sum / (cfg->workers * sumsq) : 1.0,
+	       max ? (double)min / max : 1.0);
+}
+
+int main(int argc, char **argv)
+{
+	struct lg_cfg cfg = {
+		.path = NULL,
+		.workers = 4,
+		.pin = 1,
+		.duration = 5,
+		.batch = LG_BATCH,
+		.policy = -1,
+		.method = LG_READ,
+	};
+	struct imu_client *ctl = NULL;
+	struct imu_info info;
+	long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	struct lg_worker *w;
+	unsigned int i, started = 0, nworkers;
+	uint64_t start;
+	pid_t pid;
+	int ret = 0;
+
+	if (lg_parse(argc, argv, &cfg)) {
+		usage(argv[0]);
+		return 2;
+	}
+	if (ncpu < 1)
+		ncpu = 1;
+
+	/* the rate is per instance, so any file will do to set and read it */
+	ctl = imu_open(cfg.path, IMU_OPEN_NONBLOCK);
+	if (!ctl || (cfg.rate && imu_set_rate(ctl, cfg.rate) < 0) ||
+	    imu_get_info(ctl, &info) < 0) {
+		perror(cfg.path ? cfg.path : DEVICE_FILE_NAME);
+		imu_close(ctl);
+		return 1;
+	}
+	imu_close(ctl);
+	ctl = NULL;
+	/* timer records are one period apart unless decimated or paused */
+	if (info.clock_id == IMU_CLOCK_MONOTONIC && info.decimation <= 1 &&
+	    cfg.policy != IMU_OVERRUN_BLOCK && info.sample_rate_hz)
+		cfg.period_ns = 1000000000ULL / info.sample_rate_hz;
+	if (cfg.shared) {
+		ctl = lg_open(&cfg);
+		if (!ctl) {
+			perror(cfg.path ? cfg.path : DEVICE_FILE_NAME);
+			return 1;
+		}
+	}
+
+	nworkers = cfg.workers;
+	w = mmap(NULL, nworkers * sizeof(*w), PROT_READ | PROT_WRITE,
+		 MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (w == MAP_FAILED) {
+		perror("mmap");
+		imu_close(ctl);
+		return 1;
+	}
+	for (i = 0; i < cfg.workers; i++) {
+		w[i].cfg = &cfg;
+		w[i].c = ctl;
+		w[i].id = i;
+		w[i].cpu = cfg.pin ? (int)(i % ncpu) : -1;
+	}
+
+	start = now_ns();
+	for (started = 0; started < cfg.workers; started++) {
+		if (cfg.procs) {
+			pid = fork();
+			if (pid == 0) {
+				lg_worker_main(&w[started]);
+				_exit(0);
+			}
+			if (pid < 0)
+				break;
+		} else if (pthread_create(&w[started].tid, NULL,
+					  lg_worker_main, &w[started])) {
+			break;
+		}
+	}
+	if (started < cfg.workers) {
+		fprintf(stderr, "only %u of %u workers started\n", started,
+			cfg.workers);
+		ret = 1;
+	}
+	for (i = 0; i < started; i++) {
+		if (cfg.procs)
+			wait(NULL);
+		else
+			pthread_join(w[i].tid, NULL);
+	}
+	cfg.workers = started;
+	lg_report(&cfg, w, (now_ns() - start) / 1e9);
+
+	for (i = 0; i < started; i++)
+		if (w[i].err)
+			ret = 1;
+	munmap(w, nworkers * sizeof(*w));
+	imu_close(ctl);
+	return ret;
+}
@@ -6,145 +6,2426 @@
 #include <linux/fs.h>
 #include <linux/device.h>
 #include <linux/cdev.h>
-#include <linux/random.h>
+#include <linux/math64.h>
+#include <linux/fixp-arith.h>
+#if __has_include(<linux/int_sqrt.h>)
+#include <linux/int_sqrt.h>
+#endif
 #include <linux/init.h>
 #include <linux/uaccess.h> 
+#include <linux/uio.h>
 #include <linux/time.h>
+#include <linux/ktime.h>
 #include <linux/sched.h>
+#include <linux/sched/signal.h>
 #include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/hrtimer.h>
+#include <linux/wait.h>
+#include <linux/mutex.h>
+#include <linux/mm.h>
+#include <linux/poll.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/atomic.h>
+#include <linux/cpumask.h>
+#include <linux/smp.h>
+#include <linux/topology.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 
 #include "chardev.h"
+
+#define CREATE_TRACE_POINTS
+#include "imu_char_trace.h"
 #define DEVICE_NAME "imu_char"
 #define SUCCESS 100
 
+#define IMU_MAX_SAMPLE_RATE 100000	/* Hz */
+#define IMU_MIN_RING_ORDER 4
+#define IMU_MAX_RING_ORDER 20
+#define IMU_MAX_DEVICES 64
+#define IMU_ADC_RANGE 1023		/* synthetic values are 0..1022 */
+#define IMU_FILL_BATCH 32		/* samples generated per fill call */
+#define IMU_MIN_TICK_NS (50 * NSEC_PER_USEC)
+#define IMU_MAX_REPLAY_SPEED 1000
+#define IMU_MAX_DECIMATION 256
+#define IMU_MOVAVG_MAX 64
+#define IMU_CIC_MAX_ORDER 4
+#define IMU_IIR_MAX_SHIFT 15
+#define IMU_FX_ONE (1LL << 30)		/* Q30 fixed point */
+#define IMU_FX_HALF (1LL << 29)
+#define IMU_GYRO_Q30_PER_COUNT 18740330	/* 1 deg/s in rad/s, Q30 */
+#define IMU_FUSION_MAX_DT_NS (250 * NSEC_PER_MSEC)
+#define IMU_FUSION_MAX_KP (2 << 16)	/* keeps 2Kp * error within s64 */
+#define IMU_SCAN_MOTION (IMU_SCAN_RAW & ~BIT(IMU_CHAN_PRESSURE))
+#define IMU_EVENT_QUEUE 256		/* events, a power of 2 */
+#define IMU_SPACE_POLL_MS 10		/* replay recheck of a full ring */
+#define IMU_HIST_BUCKETS 40		/* log2 ns, the last open-ended */
 
-static uint16_t message;
-//static uint16_t *message_ptr;
-static char alignment;
 
 
 static dev_t first;//variable for device number
-static struct cdev c_dev;//variable for the charecter device structure
 static struct class *cls;//variable for the device class
 
+static unsigned int sample_rate_hz = 100;
+module_param(sample_rate_hz, uint, 0444);
+MODULE_PARM_DESC(sample_rate_hz, "Initial acquisition rate in Hz (default 100)");
+
+static unsigned int source = IMU_SOURCE_RANDOM;
+module_param(source, uint, 0444);
+MODULE_PARM_DESC(source, "Initial data source: 0 random, 1 waveform (default 0)");
+
+static unsigned long seed = 1;
+module_param(seed, ulong, 0444);
+MODULE_PARM_DESC(seed, "Initial data source seed, plus the instance number (default 1)");
+
+static unsigned int num_devices = 1;
+module_param(num_devices, uint, 0444);
+MODULE_PARM_DESC(num_devices, "Number of independent instances, /dev/imu_char0.. (default 1)");
+
+static unsigned int ring_order = 10;
+module_param(ring_order, uint, 0444);
+MODULE_PARM_DESC(ring_order, "Sample ring holds 2^ring_order records (default 10)");
+
+/*
+ * Single-producer/multi-consumer sample ring. The acquisition timer, or
+ * trace replay in its place, is the only producer and advances head,
+ * serialised by engine.lock. Every open file has its own read
+ * cursor, so readers never write shared state and never take a lock on
+ * the data path. Indices run freely and are masked on access.
+ *
+ * By default a file is IMU_OVERRUN_OVERWRITE and may be lapped, so a
+ * file that never reads costs the others nothing: the producer announces
+ * the slots it is about to fill in reserve before writing them, and such
+ * readers copy records out first and check reserve afterwards. Only files
+ * that opt in to IMU_OVERRUN_DROP or IMU_OVERRUN_BLOCK hold the producer
+ * back. It caches the slowest such cursor in min_tail and only walks the
+ * reader list again when the ring looks full. A full ring drops the
+ * newest sample, or, while any IMU_OVERRUN_BLOCK reader is open, the
+ * producers generate no more than fits instead.
+ *
+ * The control page and the records are one vmalloc_user() area so the
+ * whole ring can be mapped by mmap() readers. head is kept privately and
+ * published to ctrl->data_head. The one file that has the ring mapped
+ * uses ctrl->data_tail as its cursor, since it advances it with plain
+ * stores from userspace.
+ */
+struct imu_ring {
+	struct imu_ring_ctrl *ctrl;	/* first page of the mapping */
+	struct imu_sample *data;	/* mask + 1 records after ctrl */
+	size_t mmap_size;
+	unsigned int mask;
+	u64 head;			/* next slot the producer fills */
+	u64 reserve;			/* end of the slots being filled */
+	u64 min_tail;			/* producer's view of the slowest reader */
+	u64 dropped;			/* samples lost to a full ring */
+	u64 blocked;			/* sample periods paused for a full ring */
+	u32 seq;			/* seq of the next record offered */
+	atomic64_t next_wake;		/* head at which a sleeper wants waking */
+	wait_queue_head_t wait;		/* readers waiting for samples */
+	unsigned int blockers;		/* IMU_OVERRUN_BLOCK readers */
+	wait_queue_head_t space_wait;	/* replay waiting on them */
+	spinlock_t readers_lock;	/* protects readers and mapped_by */
+	struct list_head readers;	/* every open struct imu_file */
+	struct imu_file *mapped_by;	/* file whose cursor is ctrl->data_tail */
+	u32 scan_mask;			/* union of the readers' scan masks */
+};
+
+/*
+ * Event queue. The producer appends under engine.lock and overwrites the
+ * oldest events when a reader lags; readers copy an event out and then
+ * check it was not overwritten meanwhile, so they never block it.
+ */
+struct imu_events {
+	struct imu_event buf[IMU_EVENT_QUEUE];
+	u64 head;			/* next slot the producer fills */
+	wait_queue_head_t wait;		/* readers waiting for events */
+};
+
+/*
+ * Running statistics of one window. Sums are exact for any __u16 value,
+ * as a mapped reader can store anything in the ring: a window holds at
+ * most 2^IMU_MAX_RING_ORDER samples, so sum stays below 2^36 and sumsq
+ * below 2^52.
+ */
+struct imu_stats_acc {
+	u32 window;			/* samples per window, 0 when off */
+	u32 left;			/* samples still needed, 0 when off */
+	u64 first_ns;
+	u64 last_ns;
+	u16 min[IMU_NUM_CHANNELS];
+	u16 max[IMU_NUM_CHANNELS];
+	u64 sum[IMU_NUM_CHANNELS];
+	u64 sumsq[IMU_NUM_CHANNELS];
+};
+
+/*
+ * Per-open-file state. Everything a reader changes lives here, so
+ * readers in different processes never write the same cache lines.
+ */
+struct imu_file {
+	struct imu_dev *dev;		/* instance this file was opened on */
+	struct list_head node;		/* on ring.readers */
+	u64 cursor;			/* next record this reader drains */
+	u64 *tailp;			/* &cursor, or &ctrl->data_tail once mapped */
+	unsigned int watermark;		/* samples queued before waking us */
+	u16 last[IMU_NUM_CHANNELS];	/* channels of the last record read */
+	u32 scan_mask;			/* channels packed into each record */
+	u32 format;			/* enum imu_format */
+	size_t record_size;		/* bytes per record, at most for delta */
+	struct imu_sample prev;		/* last record read, IMU_FORMAT_DELTA */
+	u8 *bounce;			/* packing buffer, one page */
+	struct imu_stats_acc stats;	/* statistics mode, under lock */
+	u64 event_cursor;		/* next event this reader takes */
+	u32 policy;			/* enum imu_overrun_policy */
+	u64 dropped_base;		/* ring.dropped at open() */
+	u64 blocked_base;		/* ring.blocked at open() */
+	u64 overwritten;		/* samples lost to being lapped */
+	pid_t pid;			/* opener, for debugfs */
+	char comm[TASK_COMM_LEN];
+	u64 dequeues;			/* batches taken from the ring */
+	u64 records;			/* records in them */
+	u64 depth_sum;			/* queue depth each batch found */
+	u64 depth_max;
+	struct mutex lock;		/* serialises read() and layout changes */
+};
+
+/*
+ * Synthetic data engine. A source fills n consecutive samples starting at
+ * a given sample index, producing only the channels in mask (the others
+ * read as 0). Sources are pure functions of the engine configuration and
+ * the index, built on a counter-based generator, so a seed always yields
+ * the same stream whichever CPU the timer or an ioctl runs on, and no
+ * generator state is shared between them.
+ */
+struct imu_engine;
+
+struct imu_source {
+	const char *name;
+	void (*fill)(const struct imu_engine *e, struct imu_sample *s,
+		     unsigned int n, u64 index, u32 mask);
+};
+
+/*
+ * Trace replay through write(). While a replay mode is set the timer
+ * stops generating and written records are queued instead, either at
+ * once or paced by their own timestamps: a record is due at
+ * base_wall_ns + (timestamp - base_rec_ns) / speed.
+ */
+struct imu_replay {
+	u32 mode;			/* enum imu_replay_mode */
+	u32 speed;			/* IMU_REPLAY_TIMED speed-up factor */
+	u32 clock_id;			/* clock of ring timestamps */
+	bool started;			/* bases taken from the first record */
+	u64 base_rec_ns;
+	u64 base_wall_ns;
+};
+
+/*
+ * Filter stage between acquisition and the ring, one filter per channel,
+ * all in integer arithmetic. Every channel is decimated by the same
+ * factor so that the emitted records stay aligned; only every
+ * decimation-th input produces an output record, stamped with the time
+ * of the newest input it covers.
+ */
+struct imu_chan_filter {
+	u32 type;			/* enum imu_filter_type */
+	u32 param;
+	u64 sum;			/* MOVAVG: sum of hist[] */
+	unsigned int pos;		/* MOVAVG: next hist[] slot */
+	u16 hist[IMU_MOVAVG_MAX];	/* MOVAVG: last param inputs */
+	u64 integ[IMU_CIC_MAX_ORDER];	/* CIC: integrators, modulo 2^64 */
+	u64 comb[IMU_CIC_MAX_ORDER];	/* CIC: comb delay lines */
+	s64 y;				/* IIR: output, Q16 */
+};
+
+struct imu_filter {
+	bool active;			/* anything but pass-through configured */
+	unsigned int decimation;
+	unsigned int phase;		/* inputs since the last output */
+	struct imu_chan_filter ch[IMU_NUM_CHANNELS];
+};
+
+/*
+ * Orientation fusion: a Mahony filter in Q30 fixed point, run once per
+ * sample ahead of the filter stage so that every consumer shares one
+ * result instead of each running its own.
+ */
+struct imu_fusion {
+	bool enabled;
+	s64 two_kp;			/* Q30 */
+	s64 q[4];			/* unit quaternion w, x, y, z, Q30 */
+	u64 last_ns;			/* timestamp of the previous sample */
+};
+
+struct imu_detector {
+	u8 type;			/* enum imu_event_type */
+	bool armed;			/* condition cleared since it last fired */
+	bool have_prev;			/* prev holds a value, for SLOPE */
+	u16 threshold;
+	u16 hysteresis;
+	u16 prev;
+};
+
+struct imu_engine {
+	const struct imu_source *source;
+	u64 seed;
+	u64 index;			/* index of the next timer sample */
+	u64 next_ns;			/* nominal time of the next timer sample */
+	struct imu_waveform wave[IMU_NUM_CHANNELS];
+	u32 step[IMU_NUM_CHANNELS];	/* phase advance per sample, 2^32 = 1 turn */
+	struct imu_replay replay;
+	struct imu_filter filter;
+	struct imu_fusion fusion;
+	struct imu_detector det[IMU_NUM_CHANNELS];
+	u32 det_mask;			/* channels with a detector */
+	spinlock_t lock;		/* configuration, and serialises producers */
+};
+
+/* Default waveforms: a slowly rocking board sitting flat, in ADC counts */
+static const struct imu_waveform imu_default_wave[IMU_NUM_CHANNELS] = {
+	[IMU_CHAN_GYRO_X]   = { IMU_CHAN_GYRO_X,   512, 60, 500, 3,  0 },
+	[IMU_CHAN_GYRO_Y]   = { IMU_CHAN_GYRO_Y,   512, 40, 700, 3,  0 },
+	[IMU_CHAN_GYRO_Z]   = { IMU_CHAN_GYRO_Z,   512, 20, 300, 3,  1 },
+	[IMU_CHAN_ACCEL_X]  = { IMU_CHAN_ACCEL_X,  512, 10, 200, 4,  0 },
+	[IMU_CHAN_ACCEL_Y]  = { IMU_CHAN_ACCEL_Y,  512, 10, 300, 4,  0 },
+	[IMU_CHAN_ACCEL_Z]  = { IMU_CHAN_ACCEL_Z,  768,  5, 200, 4,  0 },
+	[IMU_CHAN_MAGN_X]   = { IMU_CHAN_MAGN_X,   600, 30,  50, 2,  0 },
+	[IMU_CHAN_MAGN_Y]   = { IMU_CHAN_MAGN_Y,   450, 30,  50, 2,  0 },
+	[IMU_CHAN_MAGN_Z]   = { IMU_CHAN_MAGN_Z,   520, 10,  50, 2,  0 },
+	[IMU_CHAN_PRESSURE] = { IMU_CHAN_PRESSURE, 700,  2,  10, 1, -1 },
+};
+
+/*
+ * Latency histograms, per CPU so that producers and readers only ever
+ * increment their own copy. Bucket b counts latencies in
+ * [2^(b-1), 2^b) ns, bucket 0 those of 0; debugfs sums the CPUs.
+ * acq_enq runs from a sample's timestamp, its nominal acquisition time,
+ * to its entering the ring; enq_deq from there to a read() taking it.
+ */
+struct imu_hist {
+	u64 acq_enq[IMU_HIST_BUCKETS];
+	u64 enq_deq[IMU_HIST_BUCKETS];
+};
+
+/*
+ * One simulated sensor, /dev/imu_char<id>. Instances share no state:
+ * each has its own ring, engine and acquisition timer, the timer pinned
+ * to its own CPU and the structure allocated on that CPU's node, so
+ * instances scale across cores.
+ */
+struct imu_dev {
+	struct imu_ring ring;
+	struct imu_engine engine;
+	struct imu_events events;
+	struct imu_latest *latest;	/* one vmalloc_user() page */
+	struct hrtimer timer;
+	ktime_t sample_period;
+	unsigned int rate_hz;
+	struct imu_sample fill_buf[IMU_FILL_BATCH];	/* timer only */
+	struct cdev cdev;
+	unsigned int id;
+	unsigned int cpu;		/* the timer runs here */
+	struct imu_hist __percpu *hist;
+	u64 *enq_ns;			/* when each ring slot was filled */
+	struct dentry *debugfs;		/* imu_char/imu_charN */
+};
+
+static struct imu_dev **imu_devs;	/* num_devices instances */
+
+/* splitmix64 finaliser: a full-avalanche mix of a 64-bit counter */
+static inline u64 imu_mix(u64 x)
+{
+	x += 0x9e3779b97f4a7c15ULL;
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+/* 64 random bits for one lane (0..15) of one sample */
+static inline u64 imu_rand(const struct imu_engine *e, u64 index,
+			   unsigned int lane)
+{
+	return imu_mix(e->seed + (index << 4) + lane);
+}
+
+/* Map 16 random bits onto 0..n-1 without a division */
+static inline u32 imu_scale(u64 r, u32 n)
+{
+	return ((u32)(u16)r * n) >> 16;
+}
+
+/* Uniform noise over the whole ADC range, four channels per draw */
+static void imu_fill_random(const struct imu_engine *e, struct imu_sample *s,
+			    unsigned int n, u64 index, u32 mask)
+{
+	unsigned int i, ch;
+	u64 r = 0;
+
+	for (i = 0; i < n; i++, index++) {
+		for (ch = 0; ch < IMU_NUM_CHANNELS; ch++, r >>= 16) {
+			if (!(ch & 3))
+				r = (mask >> ch) & 0xf ? imu_rand(e, index, ch >> 2) : 0;
+			s[i].channel[ch] = (mask & BIT(ch)) ?
+					   imu_scale(r, IMU_ADC_RANGE) : 0;
+		}
+	}
+}
+
+/*
+ * offset + amplitude * sin(2 pi f n / rate) + uniform noise + drift, all
+ * in integer ADC counts. drift is in counts per 1000 samples.
+ */
+static void imu_fill_waveform(const struct imu_engine *e, struct imu_sample *s,
+			      unsigned int n, u64 index, u32 mask)
+{
+	const struct imu_waveform *w;
+	unsigned int i, ch;
+	u32 phase;
+	s32 v;
+
+	for (i = 0; i < n; i++, index++) {
+		for (ch = 0; ch < IMU_NUM_CHANNELS; ch++) {
+			if (!(mask & BIT(ch))) {
+				s[i].channel[ch] = 0;
+				continue;
+			}
+			w = &e->wave[ch];
+			phase = (u32)(index * e->step[ch]);
+			v = w->offset + (s32)(((s64)w->amplitude *
+				fixp_sin32_rad(phase >> 16, 1U << 16)) >> 31);
+			if (w->noise)
+				v += (s32)imu_scale(imu_rand(e, index, ch),
+						    2 * w->noise + 1) - w->noise;
+			v += (s32)div_s64((s64)w->drift * (s64)index, 1000);
+			s[i].channel[ch] = clamp_t(s32, v, 0, IMU_ADC_RANGE - 1);
+		}
+	}
+}
+
+static const struct imu_source imu_sources[IMU_NUM_SOURCES] = {
+	[IMU_SOURCE_RANDOM]   = { "random",   imu_fill_random },
+	[IMU_SOURCE_WAVEFORM] = { "waveform", imu_fill_waveform },
+};
+
+/* Recompute the waveform phase steps; engine.lock held */
+static void imu_engine_update_steps(struct imu_dev *d)
+{
+	u64 millihz = (u64)d->rate_hz * 1000;
+	int ch;
+
+	for (ch = 0; ch < IMU_NUM_CHANNELS; ch++)
+		d->engine.step[ch] = div64_u64((u64)d->engine.wave[ch].freq_mhz << 32,
+					    millihz);
+}
+
+/* Zero everything after the raw channels; the fusion fills it in later */
+static inline void imu_clear_extra(struct imu_sample *s)
+{
+	memset(s->quat, 0, sizeof(*s) - offsetof(struct imu_sample, quat));
+}
+
+/*
+ * On-demand reading of every channel, outside the timer stream. It uses
+ * the index of the next timer sample, so it is reproducible too. All
+ * channels share one timestamp so that a snapshot can be used as a single
+ * 9-DoF + pressure measurement.
+ */
+static void imu_snapshot(struct imu_dev *d, struct imu_sample *s)
+{
+	spin_lock_bh(&d->engine.lock);
+	d->engine.source->fill(&d->engine, s, 1, d->engine.index, IMU_SCAN_RAW);
+	spin_unlock_bh(&d->engine.lock);
+	s->timestamp_ns = ktime_get_ns();
+	s->seq = 0;
+	imu_clear_extra(s);
+}
+
+/*
+ * The producer only acquires channels some open file has in its scan
+ * mask. Called with readers_lock held whenever a mask or the reader set
+ * changes.
+ */
+static void imu_update_scan_mask(struct imu_dev *d)
+{
+	struct imu_file *ctx;
+	u32 mask = 0;
+
+	list_for_each_entry(ctx, &d->ring.readers, node)
+		mask |= ctx->scan_mask;
+	WRITE_ONCE(d->ring.scan_mask, mask);
+}
+
+/*
+ * Pack one record in a file's scan layout: the timestamp, seq if
+ * enabled, the enabled channels in channel order, the orientation if
+ * enabled, then zero padding to a multiple of 8 bytes. For IMU_SCAN_ALL
+ * this is exactly struct imu_sample.
+ */
+static void imu_pack_sample(const struct imu_sample *s, u32 mask, u8 *out,
+			    size_t size)
+{
+	__u16 *v = (__u16 *)(out + sizeof(s->timestamp_ns));
+	int ch;
+
+	memcpy(out, &s->timestamp_ns, sizeof(s->timestamp_ns));
+	if (mask & IMU_SCAN_SEQ) {
+		memcpy(v, &s->seq, sizeof(s->seq));
+		v += sizeof(s->seq) / sizeof(*v);
+	}
+	for (ch = 0; ch < IMU_NUM_CHANNELS; ch++)
+		if (mask & BIT(ch))
+			*v++ = s->channel[ch];
+	if (mask & IMU_SCAN_ORIENTATION) {
+		memcpy(v, s->quat, IMU_ORIENTATION_WORDS * sizeof(*v));
+		v += IMU_ORIENTATION_WORDS;
+	}
+	while ((u8 *)v < out + size)
+		*v++ = 0;
+}
+
+/* The same record with every word widened to 32 bits, IMU_FORMAT_S32 */
+static void imu_pack_s32(const struct imu_sample *s, u32 mask, u8 *out,
+			 size_t size)
+{
+	__s32 *v = (__s32 *)(out + sizeof(s->timestamp_ns));
+	int ch, i;
+
+	memcpy(out, &s->timestamp_ns, sizeof(s->timestamp_ns));
+	if (mask & IMU_SCAN_SEQ) {
+		memcpy(v, &s->seq, sizeof(s->seq));
+		v++;
+	}
+	for (ch = 0; ch < IMU_NUM_CHANNELS; ch++)
+		if (mask & BIT(ch))
+			*v++ = s->channel[ch];
+	if (mask & IMU_SCAN_ORIENTATION) {
+		for (i = 0; i < ARRAY_SIZE(s->quat); i++)
+			*v++ = s->quat[i];
+		for (i = 0; i < ARRAY_SIZE(s->euler); i++)
+			*v++ = s->euler[i];
+	}
+	while ((u8 *)v < out + size)
+		*v++ = 0;
+}
+
+static u8 *imu_put_varint(u8 *p, u64 v)
+{
+	while (v >= 0x80) {
+		*p++ = v | 0x80;
+		v >>= 7;
+	}
+	*p++ = v;
+	return p;
+}
+
+static u8 *imu_put_delta(u8 *p, s64 delta)
+{
+	/* zigzag, so that small negative steps stay short too */
+	return imu_put_varint(p, ((u64)delta << 1) ^ (u64)(delta >> 63));
+}
+
+/*
+ * Encode a record as varint deltas from prev, the last record this file
+ * read, and make it the new prev. Returns the bytes written, at most
+ * IMU_DELTA_RECORD_MAX(mask).
+ */
+static size_t imu_pack_delta(const struct imu_sample *s,
+			     struct imu_sample *prev, u32 mask, u8 *out)
+{
+	u8 *p = out;
+	int ch, i;
+
+	p = imu_put_delta(p, (s64)(s->timestamp_ns - prev->timestamp_ns));
+	if (mask & IMU_SCAN_SEQ)
+		p = imu_put_delta(p, (s32)(s->seq - prev->seq));
+	for (ch = 0; ch < IMU_NUM_CHANNELS; ch++)
+		if (mask & BIT(ch))
+			p = imu_put_delta(p, (s32)s->channel[ch] - prev->channel[ch]);
+	if (mask & IMU_SCAN_ORIENTATION) {
+		for (i = 0; i < ARRAY_SIZE(s->quat); i++)
+			p = imu_put_delta(p, (s32)s->quat[i] - prev->quat[i]);
+		for (i = 0; i < ARRAY_SIZE(s->euler); i++)
+			p = imu_put_delta(p, (s32)s->euler[i] - prev->euler[i]);
+	}
+	*prev = *s;
+	return p - out;
+}
+
+static size_t imu_record_size(u32 format, u32 mask)
+{
+	switch (format) {
+	case IMU_FORMAT_S32:
+		return IMU_S32_RECORD_SIZE(mask);
+	case IMU_FORMAT_DELTA:
+		return IMU_DELTA_RECORD_MAX(mask);
+	default:
+		return IMU_SCAN_RECORD_SIZE(mask);
+	}
+}
+
+/*
+ * Samples waiting for this reader. A mapped reader's tail is user
+ * writable, so never report more than one full ring.
+ */
+static u64 imu_file_queued(struct imu_file *ctx, u64 head)
+{
+	return min_t(u64, head - READ_ONCE(*ctx->tailp), ctx->dev->ring.mask + 1);
+}
+
+/* Ask the producer to wake the queue once head reaches at */
+static void imu_arm_wakeup(struct imu_dev *d, u64 at)
+{
+	s64 old = atomic64_read(&d->ring.next_wake);
+	s64 prev;
+
+	while ((s64)at < old) {
+		prev = atomic64_cmpxchg(&d->ring.next_wake, old, at);
+		if (prev == old)
+			break;
+		old = prev;
+	}
+}
+
+/*
+ * Samples a reader waits for: the rest of its statistics window, or its
+ * watermark.
+ */
+static unsigned int imu_file_need(struct imu_file *ctx)
+{
+	unsigned int left = READ_ONCE(ctx->stats.left);
+
+	return left ? left : READ_ONCE(ctx->watermark);
+}
+
+/*
+ * True once the samples this reader needs are waiting for it.
+ * Otherwise arms a wakeup for the point where they will be and looks
+ * again, so that a push racing with the arming cannot be missed.
+ */
+static bool imu_file_ready(struct imu_file *ctx)
+{
+	struct imu_dev *d = ctx->dev;
+	unsigned int wm = imu_file_need(ctx);
+
+	if (imu_file_queued(ctx, smp_load_acquire(&d->ring.head)) >= wm)
+		return true;
+
+	/* the cmpxchg orders this against the head load below */
+	imu_arm_wakeup(d, READ_ONCE(*ctx->tailp) + wm);
+	return imu_file_queued(ctx, smp_load_acquire(&d->ring.head)) >= wm;
+}
+
+/*
+ * For IMU_OVERRUN_OVERWRITE readers: skip whatever the producer has
+ * lapped or is about to, counting it as lost. ctx->lock held. Call it
+ * after loading head: reserve is then at least head, so the cursor ends
+ * up no more than one ring behind and imu_file_queued() never caps it.
+ */
+static void imu_file_catch_up(struct imu_file *ctx)
+{
+	struct imu_ring *r = &ctx->dev->ring;
+	u64 oldest = READ_ONCE(r->reserve) - (r->mask + 1);
+
+	if (ctx->policy != IMU_OVERRUN_OVERWRITE)
+		return;
+	if ((s64)(oldest - ctx->cursor) > 0) {
+		trace_imu_char_overwrite(ctx->dev->id, ctx, ctx->cursor,
+					 oldest - ctx->cursor);
+		ctx->overwritten += oldest - ctx->cursor;
+		smp_store_release(&ctx->cursor, oldest);
+	}
+}
+
+/*
+ * Copy-then-validate for IMU_OVERRUN_OVERWRITE readers: true if the
+ * records from tail on were not overwritten while being read.
+ */
+static bool imu_ring_intact(struct imu_file *ctx, u64 tail)
+{
+	struct imu_ring *r = &ctx->dev->ring;
+
+	if (ctx->policy != IMU_OVERRUN_OVERWRITE)
+		return true;
+	/* the copy must be done before we look at reserve */
+	smp_rmb();
+	return READ_ONCE(r->reserve) - tail <= r->mask + 1;
+}
+
+/*
+ * Slowest cursor among the open files. A tail more than one ring behind
+ * head can only be a bogus value written through the mapping and is
+ * ignored rather than allowed to stall every other reader.
+ */
+static u64 imu_ring_min_tail(struct imu_dev *d, u64 head)
+{
+	struct imu_file *ctx;
+	u64 min = head;
+	u64 tail;
+
+	spin_lock(&d->ring.readers_lock);
+	list_for_each_entry(ctx, &d->ring.readers, node) {
+		if (ctx->policy == IMU_OVERRUN_OVERWRITE)
+			continue;
+		/* pairs with the release in my_read() or the mmap() reader */
+		tail = smp_load_acquire(ctx->tailp);
+		if (head - tail <= d->ring.mask + 1 && head - tail > head - min)
+			min = tail;
+	}
+	spin_unlock(&d->ring.readers_lock);
+
+	return min;
+}
+
+/*
+ * Free slots, looking at the readers again only if fewer than want seem
+ * free. engine.lock held.
+ */
+static unsigned int imu_ring_space(struct imu_dev *d, unsigned int want)
+{
+	struct imu_ring *r = &d->ring;
+	unsigned int space = r->mask + 1 - (r->head - r->min_tail);
+
+	if (space < want) {
+		r->min_tail = imu_ring_min_tail(d, r->head);
+		space = r->mask + 1 - (r->head - r->min_tail);
+	}
+	return space;
+}
+
+/* For replay waiting on IMU_OVERRUN_BLOCK readers */
+static bool imu_ring_has_space(struct imu_dev *d)
+{
+	bool space;
+
+	spin_lock_bh(&d->engine.lock);
+	space = !READ_ONCE(d->ring.blockers) || imu_ring_space(d, 1);
+	spin_unlock_bh(&d->engine.lock);
+	return space;
+}
+
+/* A reader advanced its cursor: a blocked replay may go on */
+static void imu_file_freed(struct imu_file *ctx)
+{
+	wait_queue_head_t *wq = &ctx->dev->ring.space_wait;
+
+	if (ctx->policy == IMU_OVERRUN_BLOCK && wq_has_sleeper(wq))
+		wake_up_interruptible(wq);
+}
+
+static unsigned int imu_hist_bucket(s64 ns)
+{
+	if (ns <= 0)
+		return 0;
+	return min_t(unsigned int, fls64(ns), IMU_HIST_BUCKETS - 1);
+}
+
+/*
+ * Bucket how long each of n records from ring position tail has been
+ * queued into lat[]. enq_ns[] is refilled along with the records, so
+ * this must come before imu_ring_intact() and before the cursor is
+ * released.
+ */
+static void imu_note_latency(struct imu_dev *d, u64 tail, unsigned int n,
+			     u32 *lat)
+{
+	u64 now = ktime_get_ns();
+	unsigned int i;
+	u64 enq;
+
+	memset(lat, 0, IMU_HIST_BUCKETS * sizeof(*lat));
+	for (i = 0; i < n; i++) {
+		enq = READ_ONCE(d->enq_ns[(tail + i) & d->ring.mask]);
+		lat[imu_hist_bucket(now - enq)]++;
+	}
+}
+
+/*
+ * n records left the ring for this reader, which found queued waiting:
+ * note the depth, and the latencies imu_note_latency() gathered.
+ * ctx->lock held.
+ */
+static void imu_note_dequeue(struct imu_file *ctx, unsigned int n,
+			     u64 queued, const u32 *lat)
+{
+	struct imu_dev *d = ctx->dev;
+	unsigned int b;
+
+	WRITE_ONCE(ctx->dequeues, ctx->dequeues + 1);
+	WRITE_ONCE(ctx->records, ctx->records + n);
+	WRITE_ONCE(ctx->depth_sum, ctx->depth_sum + queued);
+	if (queued > ctx->depth_max)
+		WRITE_ONCE(ctx->depth_max, queued);
+	for (b = 0; b < IMU_HIST_BUCKETS; b++)
+		if (lat[b])
+			this_cpu_add(d->hist->enq_deq[b], lat[b]);
+}
+
+/*
+ * One batch on its way out of the ring. Every read path consumes the
+ * same way, ctx->lock held throughout:
+ *
+ *	imu_file_take()		which records are queued
+ *	(copy or fold n of them, in a way that can be undone)
+ *	imu_file_intact()	false if lapped meanwhile: undo, take again
+ *	imu_file_commit()	hand the n slots back to the producer
+ */
+struct imu_take {
+	u64 tail;			/* first record queued */
+	u64 queued;			/* records queued from tail on */
+	u16 last[IMU_NUM_CHANNELS];	/* channels of the last record used */
+	u32 lat[IMU_HIST_BUCKETS];	/* see imu_note_latency() */
+};
+
+static u64 imu_file_take(struct imu_file *ctx, struct imu_take *t)
+{
+	/* pairs with the release in imu_ring_push() */
+	u64 head = smp_load_acquire(&ctx->dev->ring.head);
+
+	imu_file_catch_up(ctx);
+	t->queued = imu_file_queued(ctx, head);
+	t->tail = head - t->queued;
+	return t->queued;
+}
+
+/* Snapshot what commit needs of the n records used, then validate them */
+static bool imu_file_intact(struct imu_file *ctx, struct imu_take *t,
+			    unsigned int n)
+{
+	struct imu_ring *r = &ctx->dev->ring;
+
+	memcpy(t->last, r->data[(t->tail + n - 1) & r->mask].channel,
+	       sizeof(t->last));
+	imu_note_latency(ctx->dev, t->tail, n, t->lat);
+	return imu_ring_intact(ctx, t->tail);
+}
+
+/* The n records were returned as bytes bytes (0 if not yet) */
+static void imu_file_commit(struct imu_file *ctx, const struct imu_take *t,
+			    unsigned int n, size_t bytes)
+{
+	memcpy(ctx->last, t->last, sizeof(ctx->last));
+
+	/* only now may the producer reuse the slots */
+	smp_store_release(ctx->tailp, t->tail + n);
+	imu_file_freed(ctx);
+	trace_imu_char_dequeue(ctx->dev->id, ctx, t->tail, n, bytes);
+	imu_note_dequeue(ctx, n, t->queued, t->lat);
+}
+
+/* Account for n records that were never queued. engine.lock held. */
+static void imu_ring_skip(struct imu_dev *d, unsigned int n)
+{
+	trace_imu_char_drop(d->id, d->ring.seq, n, IMU_DROP_STALL);
+	WRITE_ONCE(d->ring.dropped, d->ring.dropped + n);
+	d->ring.seq += n;
+}
+
+/*
+ * Queue n samples, numbering them. Producers (the timer and trace
+ * replay) hold engine.lock, so there is never more than one at a time.
+ * Whatever does not fit is dropped.
+ */
+static void imu_ring_push(struct imu_dev *d, struct imu_sample *s,
+			  unsigned int n)
+{
+	u64 head = d->ring.head;
+	unsigned int space, first, i, b;
+	bool own_clock;
+	u64 now;
+
+	for (i = 0; i < n; i++)
+		s[i].seq = d->ring.seq + i;
+	d->ring.seq += n;
+
+	space = imu_ring_space(d, n);
+	if (space < n) {
+		trace_imu_char_drop(d->id, s[space].seq, n - space,
+				    IMU_DROP_FULL);
+		WRITE_ONCE(d->ring.dropped, d->ring.dropped + n - space);
+		n = space;
+		if (!n)
+			return;
+	}
+
+	/* pairs with the smp_rmb() in imu_ring_intact() */
+	WRITE_ONCE(d->ring.reserve, head + n);
+	smp_wmb();
+
+	/* the records may wrap around the end of the ring */
+	first = min_t(unsigned int, n, d->ring.mask + 1 - (head & d->ring.mask));
+	memcpy(&d->ring.data[head & d->ring.mask], s, first * sizeof(*s));
+	memcpy(d->ring.data, s + first, (n - first) * sizeof(*s));
+
+	/* replayed timestamps are on the trace's clock, not ours */
+	own_clock = d->engine.replay.clock_id == IMU_CLOCK_MONOTONIC;
+	now = ktime_get_ns();
+	for (i = 0; i < n; i++) {
+		d->enq_ns[(head + i) & d->ring.mask] = now;
+		if (own_clock) {
+			b = imu_hist_bucket(now - s[i].timestamp_ns);
+			this_cpu_inc(d->hist->acq_enq[b]);
+		}
+	}
+	head += n;
+
+	smp_store_release(&d->ring.head, head);
+	smp_store_release(&d->ring.ctrl->data_head, head);
+	trace_imu_char_enqueue(d->id, s[0].seq, n, head);
+
+	/*
+	 * Batch wakeups: sleepers arm next_wake with the head at which
+	 * their watermark is met, and nobody is woken before that. The
+	 * barrier orders the head store against the next_wake load and
+	 * pairs with the cmpxchg in imu_arm_wakeup().
+	 */
+	smp_mb();
+	if ((s64)head >= atomic64_read(&d->ring.next_wake)) {
+		atomic64_set(&d->ring.next_wake, S64_MAX);
+		wake_up_interruptible_poll(&d->ring.wait, EPOLLIN | EPOLLRDNORM);
+	}
+}
+
+/*
+ * Publish the newest sample for readers that want no history. latest->seq
+ * is odd while the record is being rewritten; readers retry until they
+ * see the same even value before and after their copy. The page is mapped
+ * read-only, so the driver can trust it on the ioctl path as well.
+ */
+static void imu_publish_latest(struct imu_dev *d, const struct imu_sample *s)
+{
+	WRITE_ONCE(d->latest->seq, d->latest->seq + 1);
+	smp_wmb();
+	d->latest->sample = *s;
+	smp_wmb();
+	WRITE_ONCE(d->latest->seq, d->latest->seq + 1);
+}
+
+static void imu_read_latest(struct imu_dev *d, struct imu_sample *s)
+{
+	u32 seq;
+
+	for (;;) {
+		seq = smp_load_acquire(&d->latest->seq);
+		if (seq & 1) {
+			cpu_relax();
+			continue;
+		}
+		*s = d->latest->sample;
+		smp_rmb();
+		if (READ_ONCE(d->latest->seq) == seq)
+			return;
+	}
+}
+
+/* Feed one input value through a channel filter */
+static void imu_filter_input(struct imu_chan_filter *cf, u16 x)
+{
+	unsigned int k;
+
+	switch (cf->type) {
+	case IMU_FILTER_MOVAVG:
+		cf->sum += x;
+		cf->sum -= cf->hist[cf->pos];
+		cf->hist[cf->pos] = x;
+		if (++cf->pos == cf->param)
+			cf->pos = 0;
+		break;
+	case IMU_FILTER_CIC:
+		cf->integ[0] += x;
+		for (k = 1; k < cf->param; k++)
+			cf->integ[k] += cf->integ[k - 1];
+		break;
+	case IMU_FILTER_IIR:
+		cf->y += (((s64)x << 16) - cf->y) >> cf->param;
+		break;
+	}
+}
+
+/* A channel filter's output at a decimation point; x is the newest input */
+static u16 imu_filter_output(struct imu_chan_filter *cf, unsigned int r, u16 x)
+{
+	u64 y, t, gain = 1;
+	unsigned int k;
+
+	switch (cf->type) {
+	case IMU_FILTER_MOVAVG:
+		return div_u64(cf->sum, cf->param);
+	case IMU_FILTER_CIC:
+		y = cf->integ[cf->param - 1];
+		for (k = 0; k < cf->param; k++) {
+			t = y;
+			y -= cf->comb[k];
+			cf->comb[k] = t;
+			gain *= r;
+		}
+		/* the combs undo any integrator wrap-around; gain is r^order */
+		return div64_u64(y, gain);
+	case IMU_FILTER_IIR:
+		return (cf->y + (1 << 15)) >> 16;
+	default:
+		return x;
+	}
+}
+
+/*
+ * Run n samples through the filter stage in place and return how many
+ * records it emitted. Output i only overwrites inputs already consumed.
+ * engine.lock held.
+ */
+static unsigned int imu_filter_run(struct imu_dev *d, struct imu_sample *s,
+				   unsigned int n)
+{
+	struct imu_filter *fl = &d->engine.filter;
+	unsigned int i, ch, out = 0;
+
+	if (!fl->active)
+		return n;
+
+	for (i = 0; i < n; i++) {
+		for (ch = 0; ch < IMU_NUM_CHANNELS; ch++)
+			imu_filter_input(&fl->ch[ch], s[i].channel[ch]);
+		if (++fl->phase < fl->decimation)
+			continue;
+
+		fl->phase = 0;
+		for (ch = 0; ch < IMU_NUM_CHANNELS; ch++)
+			s[out].channel[ch] = imu_filter_output(&fl->ch[ch],
+							       fl->decimation,
+							       s[i].channel[ch]);
+		s[out].timestamp_ns = s[i].timestamp_ns;
+		if (out != i)
+			memcpy(s[out].quat, s[i].quat,
+			       sizeof(*s) - offsetof(struct imu_sample, quat));
+		out++;
+	}
+	return out;
+}
+
+/* a * b for Q30 operands */
+static inline s64 imu_fx(s64 a, s64 b)
+{
+	return (a * b) >> 30;
+}
+
+/* atan(2^-i) in 0.01 degree, Q16, for the CORDIC below */
+static const s32 imu_cordic_atan[] = {
+	294912000, 174096719, 91987925, 46694507, 23437865, 11730358,
+	5866610, 2933484, 1466764, 733385, 366693, 183346, 91673, 45837,
+	22918, 11459,
+};
+
+/* atan2(y, x) in 0.01 degree by CORDIC vectoring; |x|, |y| < 2^32 */
+static s32 imu_atan2_cdeg(s64 y, s64 x)
+{
+	s64 angle = 0, t;
+	int i;
+
+	if (!x && !y)
+		return 0;
+	if (x < 0) {
+		/* rotate into the right half-plane first */
+		angle = (y >= 0 ? 18000LL : -18000LL) << 16;
+		x = -x;
+		y = -y;
+	}
+	for (i = 0; i < ARRAY_SIZE(imu_cordic_atan); i++) {
+		t = x;
+		if (y > 0) {
+			x += y >> i;
+			y -= t >> i;
+			angle += imu_cordic_atan[i];
+		} else {
+			x -= y >> i;
+			y += t >> i;
+			angle -= imu_cordic_atan[i];
+		}
+	}
+	return (angle + (1 << 15)) >> 16;
+}
+
+/* Scale v[0..n) to unit length in Q30; each |v[i]| < 2^30 */
+static bool imu_normalize(s64 *v, int n)
+{
+	u64 sum = 0;
+	u32 norm;
+	int i;
+
+	for (i = 0; i < n; i++)
+		sum += v[i] * v[i];
+	norm = int_sqrt64(sum);
+	if (!norm)
+		return false;
+	for (i = 0; i < n; i++)
+		v[i] = div64_s64(v[i] * IMU_FX_ONE, norm);
+	return true;
+}
+
+/*
+ * One Mahony update (9-axis when the magnetometer reads non-zero, 6-axis
+ * otherwise) followed by the quaternion and Euler outputs. Follows the
+ * reference MahonyAHRSupdate() with Ki = 0. engine.lock held.
+ */
+static void imu_fusion_update(struct imu_dev *d, struct imu_sample *s)
+{
+	struct imu_fusion *fu = &d->engine.fusion;
+	s64 *q = fu->q;
+	s64 g[3], a[3], m[3], e[3] = { 0, 0, 0 };
+	s64 q0q0, q0q1, q0q2, q0q3, q1q1, q1q2, q1q3, q2q2, q2q3, q3q3;
+	s64 hx, hy, bx, bz, vx, vy, vz, wx, wy, wz;
+	s64 qa, qb, qc, half_dt, sinp;
+	u64 dt_ns = 0;
+	int i;
+
+	if (fu->last_ns && s->timestamp_ns > fu->last_ns)
+		dt_ns = min_t(u64, s->timestamp_ns - fu->last_ns,
+			      IMU_FUSION_MAX_DT_NS);
+	fu->last_ns = s->timestamp_ns;
+
+	for (i = 0; i < 3; i++) {
+		g[i] = ((s64)s->channel[IMU_CHAN_GYRO_X + i] - IMU_ADC_ZERO) *
+		       IMU_GYRO_Q30_PER_COUNT;
+		/* the extra precision survives the integer square root */
+		a[i] = ((s64)s->channel[IMU_CHAN_ACCEL_X + i] - IMU_ADC_ZERO) << 10;
+		m[i] = ((s64)s->channel[IMU_CHAN_MAGN_X + i] - IMU_ADC_ZERO) << 10;
+	}
+
+	q0q0 = imu_fx(q[0], q[0]);
+	q0q1 = imu_fx(q[0], q[1]);
+	q0q2 = imu_fx(q[0], q[2]);
+	q0q3 = imu_fx(q[0], q[3]);
+	q1q1 = imu_fx(q[1], q[1]);
+	q1q2 = imu_fx(q[1], q[2]);
+	q1q3 = imu_fx(q[1], q[3]);
+	q2q2 = imu_fx(q[2], q[2]);
+	q2q3 = imu_fx(q[2], q[3]);
+	q3q3 = imu_fx(q[3], q[3]);
+
+	if (imu_normalize(a, 3)) {
+		/* estimated direction of gravity, halved */
+		vx = q1q3 - q0q2;
+		vy = q0q1 + q2q3;
+		vz = q0q0 - IMU_FX_HALF + q3q3;
+		e[0] = imu_fx(a[1], vz) - imu_fx(a[2], vy);
+		e[1] = imu_fx(a[2], vx) - imu_fx(a[0], vz);
+		e[2] = imu_fx(a[0], vy) - imu_fx(a[1], vx);
+
+		if (imu_normalize(m, 3)) {
+			/* reference direction of Earth's magnetic field */
+			hx = 2 * (imu_fx(m[0], IMU_FX_HALF - q2q2 - q3q3) +
+				  imu_fx(m[1], q1q2 - q0q3) +
+				  imu_fx(m[2], q1q3 + q0q2));
+			hy = 2 * (imu_fx(m[0], q1q2 + q0q3) +
+				  imu_fx(m[1], IMU_FX_HALF - q1q1 - q3q3) +
+				  imu_fx(m[2], q2q3 - q0q1));
+			bx = int_sqrt64(hx * hx + hy * hy);
+			bz = 2 * (imu_fx(m[0], q1q3 - q0q2) +
+				  imu_fx(m[1], q2q3 + q0q1) +
+				  imu_fx(m[2], IMU_FX_HALF - q1q1 - q2q2));
+
+			/* estimated direction of the field, halved */
+			wx = imu_fx(bx, IMU_FX_HALF - q2q2 - q3q3) +
+			     imu_fx(bz, q1q3 - q0q2);
+			wy = imu_fx(bx, q1q2 - q0q3) + imu_fx(bz, q0q1 + q2q3);
+			wz = imu_fx(bx, q0q2 + q1q3) +
+			     imu_fx(bz, IMU_FX_HALF - q1q1 - q2q2);
+			e[0] += imu_fx(m[1], wz) - imu_fx(m[2], wy);
+			e[1] += imu_fx(m[2], wx) - imu_fx(m[0], wz);
+			e[2] += imu_fx(m[0], wy) - imu_fx(m[1], wx);
+		}
+	}
+
+	/* corrected rate times dt / 2, in Q30 radians */
+	half_dt = div_u64(dt_ns << 29, NSEC_PER_SEC);
+	for (i = 0; i < 3; i++)
+		g[i] = imu_fx(g[i] + imu_fx(fu->two_kp, e[i]), half_dt);
+
+	qa = q[0];
+	qb = q[1];
+	qc = q[2];
+	q[0] += -imu_fx(qb, g[0]) - imu_fx(qc, g[1]) - imu_fx(q[3], g[2]);
+	q[1] += imu_fx(qa, g[0]) + imu_fx(qc, g[2]) - imu_fx(q[3], g[1]);
+	q[2] += imu_fx(qa, g[1]) - imu_fx(qb, g[2]) + imu_fx(q[3], g[0]);
+	q[3] += imu_fx(qa, g[2]) + imu_fx(qb, g[1]) - imu_fx(qc, g[0]);
+	if (!imu_normalize(q, 4)) {
+		q[0] = IMU_FX_ONE;
+		q[1] = q[2] = q[3] = 0;
+	}
+
+	for (i = 0; i < 4; i++)
+		s->quat[i] = q[i] >> 16;
+
+	s->euler[0] = imu_atan2_cdeg(2 * (imu_fx(q[0], q[1]) + imu_fx(q[2], q[3])),
+				     IMU_FX_ONE - 2 * (imu_fx(q[1], q[1]) +
+						       imu_fx(q[2], q[2])));
+	sinp = clamp_t(s64, 2 * (imu_fx(q[0], q[2]) - imu_fx(q[3], q[1])),
+		       -IMU_FX_ONE, IMU_FX_ONE);
+	s->euler[1] = imu_atan2_cdeg(sinp,
+				     int_sqrt64(IMU_FX_ONE * IMU_FX_ONE -
+						sinp * sinp));
+	s->euler[2] = imu_atan2_cdeg(2 * (imu_fx(q[0], q[3]) + imu_fx(q[1], q[2])),
+				     IMU_FX_ONE - 2 * (imu_fx(q[2], q[2]) +
+						       imu_fx(q[3], q[3])));
+}
+
+/* Does the detector's condition hold for value v? */
+static bool imu_detector_hit(const struct imu_detector *det, u16 v, int slack)
+{
+	int delta;
+
+	switch (det->type) {
+	case IMU_EVENT_ABOVE:
+		return v > det->threshold - slack;
+	case IMU_EVENT_BELOW:
+		return v < det->threshold + slack;
+	case IMU_EVENT_SLOPE:
+		delta = abs((int)v - det->prev);
+		return det->have_prev && delta >= det->threshold - slack;
+	}
+	return false;
+}
+
+/*
+ * Run the detectors over n records and queue an event for every one
+ * that fires. Returns whether any did. engine.lock held.
+ */
+static bool imu_detect(struct imu_dev *d, const struct imu_sample *s,
+		       unsigned int n)
+{
+	struct imu_events *evq = &d->events;
+	struct imu_detector *det;
+	struct imu_event *ev;
+	bool fired = false;
+	unsigned int i;
+	u16 v;
+	int ch;
+
+	for (i = 0; i < n; i++) {
+		for (ch = 0; ch < IMU_NUM_CHANNELS; ch++) {
+			if (!(d->engine.det_mask & BIT(ch)))
+				continue;
+			det = &d->engine.det[ch];
+			v = s[i].channel[ch];
+			if (det->armed) {
+				if (imu_detector_hit(det, v, 0)) {
+					ev = &evq->buf[evq->head & (IMU_EVENT_QUEUE - 1)];
+					/* see imu_take_event() */
+					smp_wmb();
+					ev->timestamp_ns = s[i].timestamp_ns;
+					ev->channel = ch;
+					ev->type = det->type;
+					ev->value = v;
+					ev->lost = 0;
+					/* pairs with the acquire in imu_read_event() */
+					smp_store_release(&evq->head, evq->head + 1);
+					det->armed = false;
+					fired = true;
+				}
+			} else if (!imu_detector_hit(det, v, det->hysteresis)) {
+				det->armed = true;
+			}
+			det->prev = v;
+			det->have_prev = true;
+		}
+	}
+	return fired;
+}
+
+/*
+ * Everything a producer generates goes through here: orientation fusion,
+ * the filter stage, the event detectors, then the ring and the
+ * latest-value page. engine.lock held.
+ */
+static void imu_produce(struct imu_dev *d, struct imu_sample *s,
+			unsigned int n)
+{
+	unsigned int i;
+
+	if (d->engine.fusion.enabled)
+		for (i = 0; i < n; i++)
+			imu_fusion_update(d, &s[i]);
+
+	n = imu_filter_run(d, s, n);
+	if (!n)
+		return;
+	if (d->engine.det_mask && imu_detect(d, s, n))
+		wake_up_interruptible_poll(&d->events.wait, EPOLLPRI);
+	imu_ring_push(d, s, n);
+	imu_publish_latest(d, &s[n - 1]);
+}
+
+/*
+ * Acquisition timer. Generates every sample whose nominal time has come,
+ * IMU_FILL_BATCH at a time. At high rates the timer ticks no faster than
+ * IMU_MIN_TICK_NS and each tick fills a whole batch, so the per-sample
+ * cost is the fill itself.
+ */
+static enum hrtimer_restart imu_sample_tick(struct hrtimer *t)
+{
+	struct imu_dev *d = container_of(t, struct imu_dev, timer);
+	u64 period = ktime_to_ns(READ_ONCE(d->sample_period));
+	u32 mask = READ_ONCE(d->ring.scan_mask);
+	u64 now = ktime_get_ns();
+	unsigned int n, i;
+	u64 due;
+
+	spin_lock(&d->engine.lock);
+	/* the fusion needs the motion channels whoever reads them */
+	if (d->engine.fusion.enabled)
+		mask |= IMU_SCAN_MOTION;
+	mask |= d->engine.det_mask;
+	if (d->engine.replay.mode != IMU_REPLAY_OFF) {
+		/* the trace being written replaces the synthetic stream */
+		d->engine.next_ns = now + period;
+		goto out;
+	}
+	if (now < d->engine.next_ns)
+		goto out;
+
+	due = div64_u64(now - d->engine.next_ns, period) + 1;
+	if (READ_ONCE(d->ring.blockers)) {
+		/*
+		 * A blocking reader is full: pause rather than drop. Only
+		 * what fits is taken, and the stream resumes from now.
+		 */
+		n = imu_ring_space(d, due);
+		if (n < due) {
+			WRITE_ONCE(d->ring.blocked, d->ring.blocked + due - n);
+			due = n;
+			d->engine.next_ns = now + period - due * period;
+		}
+		if (!due)
+			goto out;
+	}
+	if (due > d->ring.mask + 1) {
+		/* after a long stall, skip what could never be queued */
+		imu_ring_skip(d, due - (d->ring.mask + 1));
+		d->engine.index += due - (d->ring.mask + 1);
+		d->engine.next_ns += (due - (d->ring.mask + 1)) * period;
+		due = d->ring.mask + 1;
+	}
+
+	while (due) {
+		n = min_t(u64, due, IMU_FILL_BATCH);
+		d->engine.source->fill(&d->engine, d->fill_buf, n,
+				       d->engine.index, mask);
+		trace_imu_char_acquire(d->id, d->engine.index, n,
+				       d->engine.next_ns);
+		for (i = 0; i < n; i++) {
+			d->fill_buf[i].timestamp_ns = d->engine.next_ns + i * period;
+			imu_clear_extra(&d->fill_buf[i]);
+		}
+		d->engine.index += n;
+		d->engine.next_ns += n * period;
+		due -= n;
+		imu_produce(d, d->fill_buf, n);
+	}
+out:
+	spin_unlock(&d->engine.lock);
+
+	hrtimer_forward_now(t, ns_to_ktime(max_t(u64, period, IMU_MIN_TICK_NS)));
+	return HRTIMER_RESTART;
+}
+
+static int imu_set_sample_rate(struct imu_dev *d, unsigned int hz)
+{
+	if (hz < 1 || hz > IMU_MAX_SAMPLE_RATE)
+		return -EINVAL;
+
+	spin_lock_bh(&d->engine.lock);
+	WRITE_ONCE(d->rate_hz, hz);
+	WRITE_ONCE(d->sample_period, ns_to_ktime(NSEC_PER_SEC / hz));
+	imu_engine_update_steps(d);
+	spin_unlock_bh(&d->engine.lock);
+	return 0;
+}
+
+/* Switch source and restart its stream at index 0 */
+static int imu_set_source(struct imu_dev *d, const struct imu_source_cfg *cfg)
+{
+	if (cfg->source >= IMU_NUM_SOURCES)
+		return -EINVAL;
+
+	spin_lock_bh(&d->engine.lock);
+	d->engine.source = &imu_sources[cfg->source];
+	d->engine.seed = cfg->seed;
+	d->engine.index = 0;
+	spin_unlock_bh(&d->engine.lock);
+	return 0;
+}
+
+/* Enter or leave replay; a new mode starts timing from the next record */
+static int imu_set_replay(struct imu_dev *d, const struct imu_replay_cfg *cfg)
+{
+	if (cfg->mode >= IMU_NUM_REPLAY_MODES)
+		return -EINVAL;
+	if (cfg->mode == IMU_REPLAY_TIMED &&
+	    (cfg->speed < 1 || cfg->speed > IMU_MAX_REPLAY_SPEED))
+		return -EINVAL;
+
+	spin_lock_bh(&d->engine.lock);
+	d->engine.replay.mode = cfg->mode;
+	d->engine.replay.speed = cfg->speed;
+	d->engine.replay.started = false;
+	WRITE_ONCE(d->engine.replay.clock_id, cfg->mode == IMU_REPLAY_OFF ?
+		   IMU_CLOCK_MONOTONIC : IMU_CLOCK_TRACE);
+	/* the mapping is writable, so userspace only ever sees a copy */
+	WRITE_ONCE(d->ring.ctrl->clock_id, d->engine.replay.clock_id);
+	spin_unlock_bh(&d->engine.lock);
+	return 0;
+}
+
+/*
+ * How many leading records of s[0..n) hold only ADC counts in range. The
+ * filter, fusion and statistics stages rely on that bound.
+ */
+static unsigned int imu_replay_valid(const struct imu_sample *s,
+				     unsigned int n)
+{
+	unsigned int i, ch;
+
+	for (i = 0; i < n; i++)
+		for (ch = 0; ch < IMU_NUM_CHANNELS; ch++)
+			if (s[i].channel[ch] > IMU_ADC_RANGE - 1)
+				return i;
+	return n;
+}
+
+/*
+ * How many leading records of s[0..n) are due now; engine.lock held. If
+ * none is, *wait_ns says how long until the first one will be.
+ */
+static unsigned int imu_replay_due(struct imu_replay *r,
+				   const struct imu_sample *s, unsigned int n,
+				   u64 *wait_ns)
+{
+	u64 now, due, rel;
+	unsigned int i;
+
+	if (r->mode != IMU_REPLAY_TIMED)
+		return n;
+
+	now = ktime_get_ns();
+	if (!r->started) {
+		r->base_rec_ns = s[0].timestamp_ns;
+		r->base_wall_ns = now;
+		r->started = true;
+	}
+
+	for (i = 0; i < n; i++) {
+		/* records from before the first one are due at once */
+		rel = s[i].timestamp_ns > r->base_rec_ns ?
+		      s[i].timestamp_ns - r->base_rec_ns : 0;
+		due = r->base_wall_ns + div_u64(rel, r->speed);
+		if (due > now) {
+			*wait_ns = due - now;
+			break;
+		}
+	}
+	return i;
+}
+
+/*
+ * Configure the filters of the channels in cfg->channels and the common
+ * decimation factor. Every filter restarts from a clean state.
+ */
+static int imu_set_filter(struct imu_dev *d, const struct imu_filter_cfg *cfg)
+{
+	struct imu_filter *fl = &d->engine.filter;
+	int ch;
+
+	if (!cfg->channels || (cfg->channels & ~IMU_SCAN_RAW))
+		return -EINVAL;
+	if (cfg->decimation < 1 || cfg->decimation > IMU_MAX_DECIMATION)
+		return -EINVAL;
+	switch (cfg->type) {
+	case IMU_FILTER_NONE:
+		break;
+	case IMU_FILTER_MOVAVG:
+		if (cfg->param < 1 || cfg->param > IMU_MOVAVG_MAX)
+			return -EINVAL;
+		break;
+	case IMU_FILTER_CIC:
+		if (cfg->param < 1 || cfg->param > IMU_CIC_MAX_ORDER)
+			return -EINVAL;
+		break;
+	case IMU_FILTER_IIR:
+		if (cfg->param < 1 || cfg->param > IMU_IIR_MAX_SHIFT)
+			return -EINVAL;
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	spin_lock_bh(&d->engine.lock);
+	for (ch = 0; ch < IMU_NUM_CHANNELS; ch++) {
+		if (cfg->channels & BIT(ch)) {
+			fl->ch[ch].type = cfg->type;
+			fl->ch[ch].param = cfg->param;
+		}
+	}
+	fl->decimation = cfg->decimation;
+	fl->phase = 0;
+	fl->active = fl->decimation > 1;
+	for (ch = 0; ch < IMU_NUM_CHANNELS; ch++) {
+		if (fl->ch[ch].type != IMU_FILTER_NONE)
+			fl->active = true;
+		fl->ch[ch].sum = 0;
+		fl->ch[ch].pos = 0;
+		memset(fl->ch[ch].hist, 0, sizeof(fl->ch[ch].hist));
+		memset(fl->ch[ch].integ, 0, sizeof(fl->ch[ch].integ));
+		memset(fl->ch[ch].comb, 0, sizeof(fl->ch[ch].comb));
+		fl->ch[ch].y = 0;
+	}
+	spin_unlock_bh(&d->engine.lock);
+	return 0;
+}
+
+static int imu_set_fusion(struct imu_dev *d, const struct imu_fusion_cfg *cfg)
+{
+	struct imu_fusion *fu = &d->engine.fusion;
+
+	if (cfg->kp > IMU_FUSION_MAX_KP)
+		return -EINVAL;
+
+	spin_lock_bh(&d->engine.lock);
+	fu->enabled = cfg->enable;
+	fu->two_kp = (s64)(cfg->kp ? cfg->kp : 1 << 16) << 14;
+	fu->q[0] = IMU_FX_ONE;
+	fu->q[1] = fu->q[2] = fu->q[3] = 0;
+	fu->last_ns = 0;
+	spin_unlock_bh(&d->engine.lock);
+	return 0;
+}
+
+static int imu_set_event(struct imu_dev *d, const struct imu_event_cfg *cfg)
+{
+	struct imu_detector *det;
+	int room;
+
+	if (cfg->channel >= IMU_NUM_CHANNELS || cfg->type >= IMU_NUM_EVENTS)
+		return -EINVAL;
+
+	/* the condition must be able to clear by hysteresis, or no re-arm */
+	switch (cfg->type) {
+	case IMU_EVENT_ABOVE:
+		room = cfg->threshold;
+		break;
+	case IMU_EVENT_BELOW:
+		room = IMU_ADC_RANGE - 1 - cfg->threshold;
+		break;
+	case IMU_EVENT_SLOPE:
+		room = cfg->threshold - 1;
+		break;
+	default:
+		room = IMU_ADC_RANGE;
+		break;
+	}
+	if ((int)cfg->hysteresis > room)
+		return -EINVAL;
+
+	spin_lock_bh(&d->engine.lock);
+	det = &d->engine.det[cfg->channel];
+	det->type = cfg->type;
+	det->threshold = cfg->threshold;
+	det->hysteresis = cfg->hysteresis;
+	det->armed = true;
+	det->have_prev = false;
+	if (cfg->type == IMU_EVENT_NONE)
+		d->engine.det_mask &= ~BIT(cfg->channel);
+	else
+		d->engine.det_mask |= BIT(cfg->channel);
+	spin_unlock_bh(&d->engine.lock);
+	return 0;
+}
+
+/*
+ * Take this file's oldest queued event, skipping any the producer has
+ * overwritten. Returns false if none is queued. ctx->lock held.
+ */
+static bool imu_take_event(struct imu_file *ctx, struct imu_event *ev)
+{
+	struct imu_events *evq = &ctx->dev->events;
+	u64 cursor = ctx->event_cursor;
+	u64 head, lost = 0;
+
+	for (;;) {
+		/* pairs with the release in imu_detect() */
+		head = smp_load_acquire(&evq->head);
+		if (cursor == head)
+			return false;
+		/*
+		 * The slot at head & mask is the one imu_detect() fills
+		 * next, so an event a whole queue behind may be torn. Its
+		 * smp_wmb() makes the head that announces a refill visible
+		 * before the refill itself, which the recheck below needs.
+		 */
+		if (head - cursor >= IMU_EVENT_QUEUE) {
+			lost += head - IMU_EVENT_QUEUE + 1 - cursor;
+			cursor = head - IMU_EVENT_QUEUE + 1;
+		}
+		*ev = evq->buf[cursor & (IMU_EVENT_QUEUE - 1)];
+		/* the copy must be done before we look at head again */
+		smp_rmb();
+		if (READ_ONCE(evq->head) - cursor < IMU_EVENT_QUEUE)
+			break;
+	}
+	WRITE_ONCE(ctx->event_cursor, cursor + 1);
+	ev->lost = min_t(u64, lost, U16_MAX);
+	return true;
+}
+
+static bool imu_event_pending(struct imu_file *ctx)
+{
+	return READ_ONCE(ctx->event_cursor) !=
+	       smp_load_acquire(&ctx->dev->events.head);
+}
+
+/* IOCTL_READ_EVENT: the oldest event, waiting for one unless O_NONBLOCK */
+static int imu_read_event(struct file *f, struct imu_file *ctx,
+			  struct imu_event *ev)
+{
+	for (;;) {
+		if (mutex_lock_interruptible(&ctx->lock))
+			return -ERESTARTSYS;
+		if (imu_take_event(ctx, ev)) {
+			mutex_unlock(&ctx->lock);
+			return 0;
+		}
+		mutex_unlock(&ctx->lock);
+
+		if (f->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+		if (wait_event_interruptible(ctx->dev->events.wait,
+					     imu_event_pending(ctx)))
+			return -ERESTARTSYS;
+	}
+}
+
+static int imu_set_waveform(struct imu_dev *d, const struct imu_waveform *w)
+{
+	if (w->channel >= IMU_NUM_CHANNELS || w->noise > IMU_ADC_RANGE)
+		return -EINVAL;
+
+	spin_lock_bh(&d->engine.lock);
+	d->engine.wave[w->channel] = *w;
+	imu_engine_update_steps(d);
+	spin_unlock_bh(&d->engine.lock);
+	return 0;
+}
+
+/* Sleep until this reader's watermark is met, unless told not to */
+static int imu_file_wait(struct imu_file *ctx, bool nonblock)
+{
+	if (imu_file_ready(ctx))
+		return 0;
+	if (nonblock)
+		return -EAGAIN;
+	if (wait_event_interruptible(ctx->dev->ring.wait, imu_file_ready(ctx)))
+		return -ERESTARTSYS;
+	return 0;
+}
 
 
 
 static int my_open(struct inode *i,struct file *f)
 {
-	printk(KERN_INFO "imu_char : open()\n");
+	struct imu_dev *d = container_of(i->i_cdev, struct imu_dev, cdev);
+	struct imu_file *ctx;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return -ENOMEM;
+	ctx->dev = d;
+	ctx->tailp = &ctx->cursor;
+	ctx->watermark = 1;
+	ctx->policy = IMU_OVERRUN_OVERWRITE;
+	ctx->scan_mask = IMU_SCAN_ALL;
+	ctx->record_size = sizeof(struct imu_sample);
+	ctx->pid = task_tgid_nr(current);
+	get_task_comm(ctx->comm, current);
+	mutex_init(&ctx->lock);
+
+	/* a new reader only sees samples taken from now on */
+	spin_lock_bh(&d->ring.readers_lock);
+	ctx->cursor = smp_load_acquire(&d->ring.head);
+	ctx->dropped_base = READ_ONCE(d->ring.dropped);
+	ctx->blocked_base = READ_ONCE(d->ring.blocked);
+	ctx->event_cursor = smp_load_acquire(&d->events.head);
+	list_add_tail(&ctx->node, &d->ring.readers);
+	imu_update_scan_mask(d);
+	spin_unlock_bh(&d->ring.readers_lock);
+
+	f->private_data = ctx;
+	trace_imu_char_open(d->id, ctx);
+	/* reads honour IOCB_NOWAIT, so io_uring need not punt them */
+	f->f_mode |= FMODE_NOWAIT;
         return 0;
 }
 
 static int my_close(struct inode *i,struct file *f)
 {
-	printk(KERN_INFO "imu_char : close()/n");
+	struct imu_file *ctx = f->private_data;
+	struct imu_dev *d = ctx->dev;
+
+	trace_imu_char_release(d->id, ctx);
+	spin_lock_bh(&d->ring.readers_lock);
+	list_del(&ctx->node);
+	if (d->ring.mapped_by == ctx)
+		d->ring.mapped_by = NULL;
+	if (ctx->policy == IMU_OVERRUN_BLOCK)
+		WRITE_ONCE(d->ring.blockers, d->ring.blockers - 1);
+	imu_update_scan_mask(d);
+	spin_unlock_bh(&d->ring.readers_lock);
+	/* the producer may have been waiting on this file */
+	wake_up_interruptible(&d->ring.space_wait);
+
+	mutex_destroy(&ctx->lock);
+	kfree(ctx->bounce);
+	kfree(ctx);
 	return 0;
 }
 
-static ssize_t my_read(struct file *f,char __user *buf, size_t len,loff_t *off)
+/*
+ * Copy n fixed-size records starting at ring position tail to the
+ * destination in this file's layout. Full records go straight from the
+ * ring; a reduced scan mask or IMU_FORMAT_S32 is packed through the
+ * bounce page a page at a time. The destination may be a user buffer
+ * or, for splice() and sendfile(), a pipe, so records reach a file or
+ * socket with no copy through user memory. On failure the iterator is
+ * left where it was.
+ */
+static int imu_copy_records(struct imu_file *ctx, struct iov_iter *to,
+			    u64 tail, size_t n)
 {
-	printk(KERN_INFO "imu_char : read()/n");
-	
-    // Number of bytes  written to the buffer
-   // char *b;
-   // int bytes_read = 0;
-    //int temp;
+	struct imu_ring *r = &ctx->dev->ring;
+	size_t rec = ctx->record_size;
+	size_t first, chunk, i, bytes, done = 0;
 
-    #ifdef DEBUG
-	printk(KERN_INFO "device_read(%p,%p,%d)\n", file, buf, length);
-    #endif
+	if (ctx->scan_mask == IMU_SCAN_ALL &&
+	    ctx->format == IMU_FORMAT_PACKED16) {
+		/* the records may wrap around the end of the ring */
+		first = min_t(size_t, n, r->mask + 1 - (tail & r->mask));
+		bytes = first * sizeof(struct imu_sample);
+		done = copy_to_iter(&r->data[tail & r->mask], bytes, to);
+		if (done == bytes) {
+			bytes = (n - first) * sizeof(struct imu_sample);
+			done += copy_to_iter(r->data, bytes, to);
+		}
+		if (done != n * rec)
+			goto fault;
+		return 0;
+	}
 
+	while (n) {
+		chunk = min_t(size_t, n, PAGE_SIZE / rec);
+		for (i = 0; i < chunk; i++) {
+			if (ctx->format == IMU_FORMAT_S32)
+				imu_pack_s32(&r->data[(tail + i) & r->mask],
+					     ctx->scan_mask, ctx->bounce + i * rec,
+					     rec);
+			else
+				imu_pack_sample(&r->data[(tail + i) & r->mask],
+						ctx->scan_mask,
+						ctx->bounce + i * rec, rec);
+		}
+		bytes = copy_to_iter(ctx->bounce, chunk * rec, to);
+		done += bytes;
+		if (bytes != chunk * rec)
+			goto fault;
+		tail += chunk;
+		n -= chunk;
+	}
+	return 0;
+fault:
+	iov_iter_revert(to, done);
+	return -EFAULT;
+}
+
+/* Start a new window; ctx->lock held */
+static void imu_stats_reset(struct imu_stats_acc *st)
+{
+	int ch;
+
+	for (ch = 0; ch < IMU_NUM_CHANNELS; ch++) {
+		st->min[ch] = U16_MAX;
+		st->max[ch] = 0;
+		st->sum[ch] = 0;
+		st->sumsq[ch] = 0;
+	}
+	WRITE_ONCE(st->left, st->window);
+}
+
+/* Fold n ring records starting at tail into the current window */
+static void imu_stats_fold(struct imu_stats_acc *st, const struct imu_ring *r,
+			   u32 mask, u64 tail, unsigned int n)
+{
+	const struct imu_sample *s;
+	unsigned int i;
+	u16 v;
+	int ch;
 
-      //put the data into the buffer
+	if (st->left == st->window)
+		st->first_ns = r->data[tail & r->mask].timestamp_ns;
+	for (i = 0; i < n; i++) {
+		s = &r->data[(tail + i) & r->mask];
+		for (ch = 0; ch < IMU_NUM_CHANNELS; ch++) {
+			if (!(mask & BIT(ch)))
+				continue;
+			v = s->channel[ch];
+			st->min[ch] = min(st->min[ch], v);
+			st->max[ch] = max(st->max[ch], v);
+			st->sum[ch] += v;
+			st->sumsq[ch] += (u32)v * v;
+		}
+	}
+	st->last_ns = r->data[(tail + n - 1) & r->mask].timestamp_ns;
+	WRITE_ONCE(st->left, st->left - n);
+}
 
-     uint16_t random,i;
-    get_random_bytes(&i, sizeof(i));
-    random = random%1023;
-    printk(KERN_INFO "random number : %d\n", i);
-    message = random;
-    copy_to_user(buf, &message, sizeof(message));
+/* Summarise a complete window */
+static void imu_stats_emit(const struct imu_stats_acc *st, u32 mask,
+			   struct imu_stats *out)
+{
+	u32 n = st->window;
+	u64 q, c, d;
+	u32 r;
+	int ch;
 
+	memset(out, 0, sizeof(*out));
+	out->first_ns = st->first_ns;
+	out->last_ns = st->last_ns;
+	out->count = n;
+	out->channels = mask;
+	for (ch = 0; ch < IMU_NUM_CHANNELS; ch++) {
+		if (!(mask & BIT(ch)))
+			continue;
+		out->ch[ch].min = st->min[ch];
+		out->ch[ch].max = st->max[ch];
+		out->ch[ch].mean = div_u64(st->sum[ch] << 8, n);
+		/*
+		 * n * variance = sumsq - sum^2 / n would need 72 bits. With
+		 * sum = q * n + r it is c - r^2 / n, c being the sum of the
+		 * squared distances from q, which is below 2^52.
+		 */
+		q = div_u64_rem(st->sum[ch], n, &r);
+		c = st->sumsq[ch] - q * (st->sum[ch] + r);
+		d = c - DIV_ROUND_UP_ULL((u64)r * r, n);
+		out->ch[ch].variance = div_u64(d << 8, n);
+	}
+}
 
+/*
+ * Statistics mode read: fold every queued sample into the running
+ * window and return a summary for each window completed, as many as fit
+ * in the user buffer. ctx->lock held.
+ */
+static ssize_t imu_read_stats(struct imu_file *ctx, struct iov_iter *to)
+{
+	size_t len = iov_iter_count(to);
+	struct imu_stats_acc *st = &ctx->stats;
+	struct imu_ring *r = &ctx->dev->ring;
+	u32 mask = ctx->scan_mask & IMU_SCAN_RAW;
+	struct imu_stats_acc saved;
+	struct imu_stats out;
+	struct imu_take t;
+	size_t done = 0;
+	unsigned int n;
+	ssize_t ret = -EAGAIN;
 
-#ifdef DEBUG
-	printk(KERN_INFO "Read %d bytes, %d left\n", bytes_read, length);
-#endif
-	return 10;
+	while (done + sizeof(out) <= len) {
+		if (!imu_file_take(ctx, &t))
+			break;
+		n = min_t(u64, t.queued, st->left);
+
+		if (ctx->policy == IMU_OVERRUN_OVERWRITE)
+			saved = *st;
+		imu_stats_fold(st, r, mask, t.tail, n);
+		if (!imu_file_intact(ctx, &t, n)) {
+			/* lapped mid-fold: undo it, start from the oldest */
+			*st = saved;
+			continue;
+		}
+		imu_file_commit(ctx, &t, n, 0);
+		if (st->left)
+			break;
+
+		imu_stats_emit(st, mask, &out);
+		imu_stats_reset(st);
+		if (copy_to_iter(&out, sizeof(out), to) != sizeof(out)) {
+			ret = -EFAULT;
+			break;
+		}
+		done += sizeof(out);
+	}
+	return done ? done : ret;
+}
+
+/*
+ * IMU_FORMAT_DELTA read: encode queued records into the bounce page
+ * until it or the destination has less than one worst-case record of
+ * room left, then copy them out. The delta chain only advances for
+ * records actually returned. ctx->lock held.
+ */
+static ssize_t imu_read_delta(struct imu_file *ctx, struct iov_iter *to)
+{
+	size_t len = iov_iter_count(to);
+	struct imu_ring *r = &ctx->dev->ring;
+	size_t max = ctx->record_size;
+	size_t done = 0, room, bytes, copied;
+	const struct imu_sample *s;
+	struct imu_sample saved;
+	struct imu_take t;
+	ssize_t ret = -EAGAIN;
+	unsigned int n;
+
+	while (done + max <= len) {
+		if (!imu_file_take(ctx, &t))
+			break;
+
+		saved = ctx->prev;
+		room = min_t(size_t, len - done, PAGE_SIZE);
+		for (n = 0, bytes = 0;
+		     n < t.queued && bytes + max <= room; n++) {
+			s = &r->data[(t.tail + n) & r->mask];
+			bytes += imu_pack_delta(s, &ctx->prev, ctx->scan_mask,
+						ctx->bounce + bytes);
+		}
+		if (!imu_file_intact(ctx, &t, n)) {
+			/* lapped mid-encode: start again from the oldest */
+			ctx->prev = saved;
+			continue;
+		}
+		copied = copy_to_iter(ctx->bounce, bytes, to);
+		if (copied != bytes) {
+			iov_iter_revert(to, copied);
+			ctx->prev = saved;
+			ret = -EFAULT;
+			break;
+		}
+		imu_file_commit(ctx, &t, n, bytes);
+		done += bytes;
+	}
+	return done ? done : ret;
+}
+
+/*
+ * Switch a file to a new encoding and scan mask; ctx->lock held.
+ * Anything but plain struct imu_sample records is packed through the
+ * bounce page. Discards the partial statistics window and restarts the
+ * delta chain.
+ */
+static int imu_file_set_layout(struct imu_file *ctx, u32 format, u32 mask)
+{
+	if ((format != IMU_FORMAT_PACKED16 || mask != IMU_SCAN_ALL) &&
+	    !ctx->bounce) {
+		ctx->bounce = kmalloc(PAGE_SIZE, GFP_KERNEL);
+		if (!ctx->bounce)
+			return -ENOMEM;
+	}
+	ctx->format = format;
+	ctx->scan_mask = mask;
+	WRITE_ONCE(ctx->record_size, imu_record_size(format, mask));
+	memset(&ctx->prev, 0, sizeof(ctx->prev));
+	imu_stats_reset(&ctx->stats);
+	return 0;
+}
 
+/*
+ * Drain as many whole records as fit in the destination, which may span
+ * several iovecs. Blocks until the watermark is met unless the file was
+ * opened O_NONBLOCK or the caller passed IOCB_NOWAIT; io_uring does the
+ * latter, and since the file is FMODE_NOWAIT its reads then complete
+ * inline or fail with -EAGAIN and wait on poll(), never going to a
+ * worker thread. Backs read() and readv() as well as splice() and
+ * sendfile().
+ */
+static ssize_t my_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+	struct file *f = iocb->ki_filp;
+	struct imu_file *ctx = f->private_data;
+	size_t len = iov_iter_count(to);
+	struct imu_take t;
+	size_t want, n;
+	bool nowait;
+	ssize_t ret;
+
+	if (len < READ_ONCE(ctx->record_size) ||
+	    (READ_ONCE(ctx->stats.window) && len < sizeof(struct imu_stats)))
+		return -EINVAL;
+
+	nowait = (f->f_flags & O_NONBLOCK) || (iocb->ki_flags & IOCB_NOWAIT);
+retry:
+	ret = imu_file_wait(ctx, nowait);
+	if (ret)
+		return ret;
+
+	/* only threads sharing this file contend here */
+	if (nowait) {
+		if (!mutex_trylock(&ctx->lock))
+			return -EAGAIN;
+	} else if (mutex_lock_interruptible(&ctx->lock)) {
+		return -ERESTARTSYS;
+	}
+
+	if (ctx->stats.window) {
+		ret = len < sizeof(struct imu_stats) ? -EINVAL :
+		      imu_read_stats(ctx, to);
+		goto out;
+	}
+	if (ctx->format == IMU_FORMAT_DELTA) {
+		ret = len < ctx->record_size ? -EINVAL :
+		      imu_read_delta(ctx, to);
+		goto out;
+	}
+
+	want = len / ctx->record_size;
+	if (!want) {
+		/* the layout grew since the check above */
+		ret = -EINVAL;
+		goto out;
+	}
+
+	for (;;) {
+		if (!imu_file_take(ctx, &t)) {
+			ret = -EAGAIN;
+			goto out;
+		}
+		n = min_t(u64, want, t.queued);
+
+		ret = imu_copy_records(ctx, to, t.tail, n);
+		if (ret)
+			goto out;
+		if (imu_file_intact(ctx, &t, n))
+			break;
+		/* lapped mid-copy: copy again from the oldest intact record */
+		iov_iter_revert(to, n * ctx->record_size);
+	}
+	ret = n * ctx->record_size;
+	imu_file_commit(ctx, &t, n, ret);
+out:
+	mutex_unlock(&ctx->lock);
+	/* another thread on this file got there first, so wait again */
+	if (ret == -EAGAIN && !nowait)
+		goto retry;
+	return ret;
 }
 	
 	
+/*
+ * Trace replay: queue whole struct imu_sample records, timestamps passed
+ * through unchanged, as fast as possible or paced by IMU_REPLAY_TIMED.
+ * Records are copied in a page at a time, checked only for channel
+ * values out of range and pushed in bulk. Returns the bytes queued,
+ * which is short if a timed write is interrupted or would block with
+ * O_NONBLOCK, or stops at a record out of range.
+ */
 static ssize_t my_write(struct file *f,const char __user *buf, size_t len,loff_t *off)
 {
-	printk(KERN_INFO "imu_char : write()/n");
-	return len;
+	struct imu_file *ctx = f->private_data;
+	struct imu_dev *d = ctx->dev;
+	size_t rec = sizeof(struct imu_sample);
+	struct imu_sample *s;
+	size_t done = 0, chunk;
+	unsigned int i, n;
+	ktime_t timeout;
+	u64 wait_ns = 0;
+	ssize_t ret = 0;
+	bool full, bad;
+	u32 mode;
+
+	if (len < rec)
+		return -EINVAL;
+	if (READ_ONCE(d->engine.replay.mode) == IMU_REPLAY_OFF)
+		return -EINVAL;
+
+	s = kmalloc(PAGE_SIZE, GFP_KERNEL);
+	if (!s)
+		return -ENOMEM;
+
+	while (len - done >= rec) {
+		chunk = min_t(size_t, (len - done) / rec, PAGE_SIZE / rec);
+		if (copy_from_user(s, buf + done, chunk * rec)) {
+			ret = -EFAULT;
+			goto out;
+		}
+		/* queue what precedes a bad record, then fail */
+		n = imu_replay_valid(s, chunk);
+		bad = n < chunk;
+		chunk = n;
+
+		for (i = 0; i < chunk; i += n) {
+			spin_lock_bh(&d->engine.lock);
+			mode = d->engine.replay.mode;
+			n = mode == IMU_REPLAY_OFF ? 0 :
+			    imu_replay_due(&d->engine.replay, s + i, chunk - i,
+					   &wait_ns);
+			full = false;
+			if (n && READ_ONCE(d->ring.blockers)) {
+				/* a blocking reader is full: wait for it */
+				n = min(n, imu_ring_space(d, n));
+				full = !n;
+			}
+			if (n)
+				imu_produce(d, s + i, n);
+			spin_unlock_bh(&d->engine.lock);
+			done += n * rec;
+
+			if (mode == IMU_REPLAY_OFF) {
+				ret = -EINVAL;
+				goto out;
+			}
+			if (n)
+				continue;
+
+			if (full) {
+				if (f->f_flags & O_NONBLOCK) {
+					ret = -EAGAIN;
+					goto out;
+				}
+				/*
+				 * A mapped reader cannot wake us, so look
+				 * again now and then.
+				 */
+				if (wait_event_interruptible_timeout(d->ring.space_wait,
+						imu_ring_has_space(d),
+						msecs_to_jiffies(IMU_SPACE_POLL_MS)) < 0) {
+					ret = -ERESTARTSYS;
+					goto out;
+				}
+				continue;
+			}
+
+			/* nothing due yet: sleep until the next record is */
+			if (f->f_flags & O_NONBLOCK) {
+				ret = -EAGAIN;
+				goto out;
+			}
+			timeout = ns_to_ktime(wait_ns);
+			set_current_state(TASK_INTERRUPTIBLE);
+			schedule_hrtimeout(&timeout, HRTIMER_MODE_REL);
+			if (signal_pending(current)) {
+				ret = -ERESTARTSYS;
+				goto out;
+			}
+		}
+		if (bad) {
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+out:
+	kfree(s);
+	return done ? done : ret;
+}
+
+
+/*
+ * Readable once the watermark is reached, so an epoll loop is woken once
+ * per batch rather than once per sample. EPOLLPRI while events are
+ * queued for this file; a caller waiting only for those is not woken by
+ * samples.
+ */
+static __poll_t my_poll(struct file *f, poll_table *wait)
+{
+	struct imu_file *ctx = f->private_data;
+	struct imu_dev *d = ctx->dev;
+	__poll_t mask = 0;
+
+	poll_wait(f, &d->ring.wait, wait);
+	poll_wait(f, &d->events.wait, wait);
+
+	if (imu_file_ready(ctx))
+		mask |= EPOLLIN | EPOLLRDNORM;
+	if (imu_event_pending(ctx))
+		mask |= EPOLLPRI;
+	return mask;
+}
+
+/*
+ * Map the latest-value page. Any number of files may map it, but only
+ * read-only since the driver trusts its contents.
+ */
+static int imu_mmap_latest(struct imu_dev *d, struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & VM_WRITE)
+		return -EPERM;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 3, 0)
+	vm_flags_clear(vma, VM_MAYWRITE);
+#else
+	vma->vm_flags &= ~VM_MAYWRITE;
+#endif
+	return remap_vmalloc_range(vma, d->latest, 0);
+}
+
+/*
+ * Map the control page and the records. The mapping must start at offset
+ * 0 and be shared so that the reader's data_tail updates reach the driver.
+ * Only one open file at a time may consume through the mapping; from then
+ * on ctrl->data_tail is that file's cursor.
+ */
+static int my_mmap(struct file *f, struct vm_area_struct *vma)
+{
+	struct imu_file *ctx = f->private_data;
+	struct imu_dev *d = ctx->dev;
+
+	if (vma->vm_pgoff == IMU_MMAP_LATEST_OFFSET >> PAGE_SHIFT)
+		return imu_mmap_latest(d, vma);
+	if (vma->vm_pgoff)
+		return -EINVAL;
+	if (!(vma->vm_flags & VM_SHARED))
+		return -EINVAL;
+
+	spin_lock_bh(&d->ring.readers_lock);
+	if (d->ring.mapped_by && d->ring.mapped_by != ctx) {
+		spin_unlock_bh(&d->ring.readers_lock);
+		return -EBUSY;
+	}
+	if (ctx->policy == IMU_OVERRUN_OVERWRITE) {
+		spin_unlock_bh(&d->ring.readers_lock);
+		return -EBUSY;
+	}
+	if (!d->ring.mapped_by) {
+		d->ring.ctrl->data_tail = ctx->cursor;
+		smp_store_release(&ctx->tailp, &d->ring.ctrl->data_tail);
+		d->ring.mapped_by = ctx;
+	}
+	spin_unlock_bh(&d->ring.readers_lock);
+
+	/* fails if the vma is larger than the ring */
+	return remap_vmalloc_range(vma, d->ring.ctrl, 0);
 }
 
 
 static long device_ioctl(struct file *file, unsigned int ioctl_num,unsigned long ioctl_param)
 
 {
-    //int i;
-    char *temp;
-    char ch;
+    struct imu_file *ctx = file->private_data;
+    struct imu_dev *d = ctx->dev;
+    struct imu_sample sample;
+    struct imu_source_cfg src;
+    struct imu_waveform wave;
+    struct imu_replay_cfg replay;
+    struct imu_info info;
+    struct imu_filter_cfg filter;
+    struct imu_fusion_cfg fusion;
+    struct imu_stats_cfg stats;
+    struct imu_event_cfg event_cfg;
+    struct imu_event event;
+    struct imu_overruns overruns;
+    __u32 val;
+    __u16 value;
+    u64 head;
+    int ret;
     
     switch (ioctl_num) {
-    	case IOCTL_GYROSCOPE_X_AXIS:        	     
-    	     temp = (char *)ioctl_param;
-             copy_to_user(temp, &message, sizeof(message));
-             get_user(ch, temp);
-	  alignment = ch;   //ch is the number sent by userspace
-         break;         
-    case IOCTL_GYROSCOPE_Y_AXIS:  
-          temp = (char *)ioctl_param;
-          copy_to_user(temp, &message, sizeof(message));  
-          get_user(ch, temp);
-	  alignment = ch;   
-         break;
-    case IOCTL_GYROSCOPE_Z_AXIS:           
-         temp = (char *)ioctl_param;
-        copy_to_user(temp, &message, sizeof(message));  
-          get_user(ch, temp);
-	 alignment = ch;   
-         break;         
-    case IOCTL_ACCELEROMETER_X_AXIS:    
-          temp = (char *)ioctl_param;
-          get_user(ch, temp);
-	  alignment = ch;   
-         break;        
-    case IOCTL_ACCELEROMETER_Y_AXIS:    
-          temp = (char *)ioctl_param;
-          get_user(ch, temp);
-	  alignment = ch;   
-         break;                           
-    case IOCTL_ACCELEROMETER_Z_AXIS:    
-          temp = (char *)ioctl_param;
-          get_user(ch, temp);
-	  alignment = ch;   
-         break;         
-    case IOCTL_MAGNETOMETER_X_AXIS:    
-          temp = (char *)ioctl_param;
-          get_user(ch, temp);
-	  alignment = ch;  
-         break;         
-    case IOCTL_MAGNETOMETER_Y_AXIS:    
-          temp = (char *)ioctl_param;
-          get_user(ch, temp);
-	  alignment = ch;   
-         break;                           
-    case IOCTL_MAGNETOMETER_Z_AXIS:    
-          temp = (char *)ioctl_param;
-          get_user(ch, temp);
-	  alignment = ch;   
-         break;           
+    /* The per-channel ioctls return that channel of the last record read */
+    case IOCTL_GYROSCOPE_X_AXIS:
+    case IOCTL_GYROSCOPE_Y_AXIS:
+    case IOCTL_GYROSCOPE_Z_AXIS:
+    case IOCTL_ACCELEROMETER_X_AXIS:
+    case IOCTL_ACCELEROMETER_Y_AXIS:
+    case IOCTL_ACCELEROMETER_Z_AXIS:
+    case IOCTL_MAGNETOMETER_X_AXIS:
+    case IOCTL_MAGNETOMETER_Y_AXIS:
+    case IOCTL_MAGNETOMETER_Z_AXIS:
     case IOCTL_BAROMETER_PRESSURE:
-          temp = (char *)ioctl_param;
-          get_user(ch, temp);
-	  alignment = ch;   
+	value = READ_ONCE(ctx->last[_IOC_NR(ioctl_num)]);
+	if (copy_to_user((void __user *)ioctl_param, &value, sizeof(value)))
+		return -EFAULT;
+	break;
+    case IOCTL_READ_ALL_CHANNELS:
+	imu_snapshot(d, &sample);
+	if (copy_to_user((void __user *)ioctl_param, &sample, sizeof(sample)))
+		return -EFAULT;
+	break;
+    case IOCTL_READ_LATEST:
+	imu_read_latest(d, &sample);
+	if (copy_to_user((void __user *)ioctl_param, &sample, sizeof(sample)))
+		return -EFAULT;
+	break;
+    case IOCTL_SET_SAMPLE_RATE:
+	if (get_user(val, (__u32 __user *)ioctl_param))
+		return -EFAULT;
+	ret = imu_set_sample_rate(d, val);
+	if (ret)
+		return ret;
+	break;
+
+    case IOCTL_WAIT_SAMPLES:
+	ret = imu_file_wait(ctx, file->f_flags & O_NONBLOCK);
+	if (ret)
+		return ret;
+	break;
+    case IOCTL_SET_WATERMARK:
+	if (get_user(val, (__u32 __user *)ioctl_param))
+		return -EFAULT;
+	if (val < 1 || val > d->ring.mask + 1)
+		return -EINVAL;
+	WRITE_ONCE(ctx->watermark, val);
+	/* other threads on this file may be waiting for a lower one */
+	wake_up_interruptible_poll(&d->ring.wait, EPOLLIN | EPOLLRDNORM);
+	break;
+
+    case IOCTL_SET_SCAN_MASK:
+	if (get_user(val, (__u32 __user *)ioctl_param))
+		return -EFAULT;
+	if (!val || (val & ~IMU_SCAN_ALL))
+		return -EINVAL;
+	if (mutex_lock_interruptible(&ctx->lock))
+		return -ERESTARTSYS;
+	ret = imu_file_set_layout(ctx, ctx->format, val);
+	mutex_unlock(&ctx->lock);
+	if (ret)
+		return ret;
+
+	spin_lock_bh(&d->ring.readers_lock);
+	imu_update_scan_mask(d);
+	spin_unlock_bh(&d->ring.readers_lock);
+	break;
+
+    case IOCTL_SET_FORMAT:
+	if (get_user(val, (__u32 __user *)ioctl_param))
+		return -EFAULT;
+	if (val >= IMU_NUM_FORMATS)
+		return -EINVAL;
+	if (mutex_lock_interruptible(&ctx->lock))
+		return -ERESTARTSYS;
+	ret = imu_file_set_layout(ctx, val, ctx->scan_mask);
+	mutex_unlock(&ctx->lock);
+	if (ret)
+		return ret;
+	break;
+
+    case IOCTL_SET_STATS:
+	if (copy_from_user(&stats, (void __user *)ioctl_param, sizeof(stats)))
+		return -EFAULT;
+	if (stats.window > d->ring.mask + 1)
+		return -EINVAL;
+	if (mutex_lock_interruptible(&ctx->lock))
+		return -ERESTARTSYS;
+	ctx->stats.window = stats.window;
+	imu_stats_reset(&ctx->stats);
+	mutex_unlock(&ctx->lock);
+	/* readiness is now measured against the new window */
+	wake_up_interruptible_poll(&d->ring.wait, EPOLLIN | EPOLLRDNORM);
+	break;
+
+    case IOCTL_SET_SOURCE:
+	if (copy_from_user(&src, (void __user *)ioctl_param, sizeof(src)))
+		return -EFAULT;
+	ret = imu_set_source(d, &src);
+	if (ret)
+		return ret;
+	break;
+    case IOCTL_SET_WAVEFORM:
+	if (copy_from_user(&wave, (void __user *)ioctl_param, sizeof(wave)))
+		return -EFAULT;
+	ret = imu_set_waveform(d, &wave);
+	if (ret)
+		return ret;
+	break;
+    case IOCTL_SET_REPLAY:
+	if (copy_from_user(&replay, (void __user *)ioctl_param, sizeof(replay)))
+		return -EFAULT;
+	ret = imu_set_replay(d, &replay);
+	if (ret)
+		return ret;
+	break;
+
+    case IOCTL_SET_FILTER:
+	if (copy_from_user(&filter, (void __user *)ioctl_param, sizeof(filter)))
+		return -EFAULT;
+	ret = imu_set_filter(d, &filter);
+	if (ret)
+		return ret;
+	break;
+    case IOCTL_SET_FUSION:
+	if (copy_from_user(&fusion, (void __user *)ioctl_param, sizeof(fusion)))
+		return -EFAULT;
+	ret = imu_set_fusion(d, &fusion);
+	if (ret)
+		return ret;
+	break;
+    case IOCTL_SET_EVENT:
+	if (copy_from_user(&event_cfg, (void __user *)ioctl_param,
+			   sizeof(event_cfg)))
+		return -EFAULT;
+	ret = imu_set_event(d, &event_cfg);
+	if (ret)
+		return ret;
+	break;
+    case IOCTL_READ_EVENT:
+	ret = imu_read_event(file, ctx, &event);
+	if (ret)
+		return ret;
+	if (copy_to_user((void __user *)ioctl_param, &event, sizeof(event)))
+		return -EFAULT;
+	break;
+
+    case IOCTL_SET_OVERRUN:
+	if (get_user(val, (__u32 __user *)ioctl_param))
+		return -EFAULT;
+	if (val >= IMU_NUM_OVERRUN_POLICIES)
+		return -EINVAL;
+	if (mutex_lock_interruptible(&ctx->lock))
+		return -ERESTARTSYS;
+	spin_lock_bh(&d->ring.readers_lock);
+	if (d->ring.mapped_by == ctx && val == IMU_OVERRUN_OVERWRITE) {
+		spin_unlock_bh(&d->ring.readers_lock);
+		mutex_unlock(&ctx->lock);
+		return -EBUSY;
+	}
+	if (ctx->policy == IMU_OVERRUN_OVERWRITE &&
+	    val != IMU_OVERRUN_OVERWRITE) {
+		/*
+		 * The producer may have moved min_tail past our cursor while
+		 * it ignored us, so start afresh. Under readers_lock, any
+		 * later rescan sees this cursor.
+		 */
+		head = smp_load_acquire(&d->ring.head);
+		trace_imu_char_overwrite(d->id, ctx, ctx->cursor,
+					 head - ctx->cursor);
+		ctx->overwritten += head - ctx->cursor;
+		smp_store_release(&ctx->cursor, head);
+	}
+	if (ctx->policy == IMU_OVERRUN_BLOCK)
+		WRITE_ONCE(d->ring.blockers, d->ring.blockers - 1);
+	if (val == IMU_OVERRUN_BLOCK)
+		WRITE_ONCE(d->ring.blockers, d->ring.blockers + 1);
+	WRITE_ONCE(ctx->policy, val);
+	spin_unlock_bh(&d->ring.readers_lock);
+	mutex_unlock(&ctx->lock);
+	wake_up_interruptible(&d->ring.space_wait);
+	break;
+    case IOCTL_GET_OVERRUNS:
+	overruns.dropped = READ_ONCE(d->ring.dropped) - ctx->dropped_base;
+	overruns.overwritten = READ_ONCE(ctx->overwritten);
+	overruns.blocked = READ_ONCE(d->ring.blocked) - ctx->blocked_base;
+	if (copy_to_user((void __user *)ioctl_param, &overruns,
+			 sizeof(overruns)))
+		return -EFAULT;
 	break;
 
-    default :  break;
+    case IOCTL_GET_INFO:
+	memset(&info, 0, sizeof(info));
+	info.version = IMU_RING_VERSION;
+	info.clock_id = READ_ONCE(d->engine.replay.clock_id);
+	info.sample_rate_hz = READ_ONCE(d->rate_hz);
+	info.source = READ_ONCE(d->engine.source) - imu_sources;
+	info.ring_size = d->ring.mask + 1;
+	info.record_size = READ_ONCE(ctx->stats.window) ?
+			   sizeof(struct imu_stats) : READ_ONCE(ctx->record_size);
+	info.scan_mask = READ_ONCE(ctx->scan_mask);
+	info.decimation = READ_ONCE(d->engine.filter.decimation);
+	if (copy_to_user((void __user *)ioctl_param, &info, sizeof(info)))
+		return -EFAULT;
+	break;
+
+    default :
+	return -ENOTTY;
     }
 
     return SUCCESS;
@@ -163,55 +2444,260 @@ static struct file_operations fops =
   .open		= my_open,
   .release		= my_close,
   .unlocked_ioctl	= device_ioctl,
-  .read		= my_read,
-  .write		= my_write
+  .read_iter		= my_read_iter,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 5, 0)
+  .splice_read		= copy_splice_read,
+#else
+  .splice_read		= generic_file_splice_read,
+#endif
+  .write		= my_write,
+  .mmap		= my_mmap,
+  .poll		= my_poll
 };
 
 
 
+/* Arm an instance's timer on the CPU this runs on, via IPI */
+static void imu_start_timer(void *arg)
+{
+	struct imu_dev *d = arg;
+
+	hrtimer_start(&d->timer, d->sample_period, HRTIMER_MODE_REL_PINNED_SOFT);
+}
+
+/*
+ * debugfs: imu_char/imu_charN/latency has the histograms summed over the
+ * CPUs, one row per non-empty bucket; imu_char/imu_charN/readers has a
+ * row per open file with its queue depth statistics.
+ */
+static struct dentry *imu_debugfs;
+
+static int imu_latency_show(struct seq_file *m, void *v)
+{
+	struct imu_dev *d = m->private;
+	u64 acq[IMU_HIST_BUCKETS] = {}, deq[IMU_HIST_BUCKETS] = {};
+	const struct imu_hist *h;
+	unsigned int b;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		h = per_cpu_ptr(d->hist, cpu);
+		for (b = 0; b < IMU_HIST_BUCKETS; b++) {
+			acq[b] += READ_ONCE(h->acq_enq[b]);
+			deq[b] += READ_ONCE(h->enq_deq[b]);
+		}
+	}
+	seq_puts(m, "# from_ns acquire_to_enqueue enqueue_to_read\n");
+	for (b = 0; b < IMU_HIST_BUCKETS; b++)
+		if (acq[b] || deq[b])
+			seq_printf(m, "%llu %llu %llu\n",
+				   b ? 1ULL << (b - 1) : 0, acq[b], deq[b]);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(imu_latency);
+
+static int imu_readers_show(struct seq_file *m, void *v)
+{
+	struct imu_dev *d = m->private;
+	struct imu_file *ctx;
+	u64 head, n;
+
+	seq_puts(m, "# pid comm policy dequeues records depth_avg depth_max "
+		    "queued\n");
+	spin_lock_bh(&d->ring.readers_lock);
+	head = smp_load_acquire(&d->ring.head);
+	list_for_each_entry(ctx, &d->ring.readers, node) {
+		n = READ_ONCE(ctx->dequeues);
+		seq_printf(m, "%d %s %u %llu %llu %llu %llu %llu\n",
+			   ctx->pid, ctx->comm, READ_ONCE(ctx->policy), n,
+			   READ_ONCE(ctx->records),
+			   n ? div64_u64(READ_ONCE(ctx->depth_sum), n) : 0,
+			   READ_ONCE(ctx->depth_max),
+			   imu_file_queued(ctx, head));
+	}
+	spin_unlock_bh(&d->ring.readers_lock);
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(imu_readers);
+
+static void imu_dev_debugfs(struct imu_dev *d)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), DEVICE_NAME "%u", d->id);
+	d->debugfs = debugfs_create_dir(name, imu_debugfs);
+	debugfs_create_file("latency", 0444, d->debugfs, d, &imu_latency_fops);
+	debugfs_create_file("readers", 0444, d->debugfs, d, &imu_readers_fops);
+}
+
+static void imu_dev_free(struct imu_dev *d)
+{
+	free_percpu(d->hist);
+	vfree(d->enq_ns);
+	vfree(d->latest);
+	vfree(d->ring.ctrl);
+	kfree(d);
+}
+
+/* Allocate and set up instance id; its timer is not started yet */
+static struct imu_dev *imu_dev_alloc(unsigned int id)
+{
+	unsigned int cpu = cpumask_local_spread(id, NUMA_NO_NODE);
+	struct imu_dev *d;
+
+	d = kzalloc_node(sizeof(*d), GFP_KERNEL, cpu_to_node(cpu));
+	if (!d)
+		return NULL;
+	d->id = id;
+	d->cpu = cpu;
+
+	spin_lock_init(&d->engine.lock);
+	d->engine.source = &imu_sources[source];
+	/* distinct instances produce distinct streams */
+	d->engine.seed = seed + id;
+	d->engine.filter.decimation = 1;
+	memcpy(d->engine.wave, imu_default_wave, sizeof(d->engine.wave));
+	imu_set_sample_rate(d, sample_rate_hz);
+
+	d->ring.mmap_size = PAGE_SIZE +
+			    PAGE_ALIGN(sizeof(struct imu_sample) << ring_order);
+	d->ring.ctrl = vmalloc_user(d->ring.mmap_size);
+	d->latest = vmalloc_user(PAGE_SIZE);
+	d->enq_ns = vzalloc(sizeof(*d->enq_ns) << ring_order);
+	d->hist = alloc_percpu(struct imu_hist);
+	if (!d->ring.ctrl || !d->latest || !d->enq_ns || !d->hist) {
+		imu_dev_free(d);
+		return NULL;
+	}
+	d->ring.data = (void *)d->ring.ctrl + PAGE_SIZE;
+	d->ring.ctrl->version = IMU_RING_VERSION;
+	d->engine.replay.clock_id = IMU_CLOCK_MONOTONIC;
+	d->ring.ctrl->clock_id = IMU_CLOCK_MONOTONIC;
+	d->ring.ctrl->record_size = sizeof(struct imu_sample);
+	d->ring.ctrl->data_offset = PAGE_SIZE;
+	d->ring.ctrl->data_size = 1U << ring_order;
+	d->ring.mask = (1U << ring_order) - 1;
+	atomic64_set(&d->ring.next_wake, S64_MAX);
+	init_waitqueue_head(&d->ring.wait);
+	init_waitqueue_head(&d->ring.space_wait);
+	init_waitqueue_head(&d->events.wait);
+	spin_lock_init(&d->ring.readers_lock);
+	INIT_LIST_HEAD(&d->ring.readers);
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&d->timer, imu_sample_tick, CLOCK_MONOTONIC,
+		      HRTIMER_MODE_REL_PINNED_SOFT);
+#else
+	hrtimer_init(&d->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_PINNED_SOFT);
+	d->timer.function = imu_sample_tick;
+#endif
+	return d;
+}
+
+static void imu_dev_remove(struct imu_dev *d)
+{
+	debugfs_remove_recursive(d->debugfs);
+	hrtimer_cancel(&d->timer);
+	device_destroy(cls, d->cdev.dev);
+	cdev_del(&d->cdev);
+	imu_dev_free(d);
+}
+
 static int __init imu_char_init(void)
 {
+	struct imu_dev *d;
+	unsigned int i;
+	int ret;
+
 	printk(KERN_INFO "Namasthe:imu_char driver registered");
-	
+
+	/* timestamps come from ktime_get_ns() and the timer's own clock */
+	BUILD_BUG_ON(IMU_CLOCK_MONOTONIC != CLOCK_MONOTONIC);
+
+	if (ring_order < IMU_MIN_RING_ORDER || ring_order > IMU_MAX_RING_ORDER)
+		return -EINVAL;
+	if (source >= IMU_NUM_SOURCES)
+		return -EINVAL;
+	if (sample_rate_hz < 1 || sample_rate_hz > IMU_MAX_SAMPLE_RATE)
+		return -EINVAL;
+	if (num_devices < 1 || num_devices > IMU_MAX_DEVICES)
+		return -EINVAL;
+
+	imu_devs = kcalloc(num_devices, sizeof(*imu_devs), GFP_KERNEL);
+	if (!imu_devs)
+		return -ENOMEM;
+	imu_debugfs = debugfs_create_dir("imu_char", NULL);
+
 	//Step_1 <major,minor>
-	if(alloc_chrdev_region(&first, 0, 1, "BITS-PILANI") < 0)
-	{
-		return -1;
-	}
-	
-	//Step_2 creating device node
-	if ((cls = class_create(THIS_MODULE, "chardrv")) == NULL)
-	{
-		unregister_chrdev_region(first, 1);
-		return -1;
-	}
-	
-	if(device_create(cls, NULL,first, NULL, "mydevice")==NULL)
-	{
-		class_destroy(cls);
-		unregister_chrdev_region(first ,1);
-		return -1;
+	ret = alloc_chrdev_region(&first, 0, num_devices, "BITS-PILANI");
+	if (ret < 0)
+		goto err_free;
+
+	//Step_2 creating device class
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 4, 0)
+	cls = class_create("chardrv");
+#else
+	cls = class_create(THIS_MODULE, "chardrv");
+#endif
+	if (IS_ERR(cls)) {
+		ret = PTR_ERR(cls);
+		goto err_region;
 	}
-	
-	//Step_3 link fops and cdev to device node
-	
-	cdev_init(&c_dev, &fops);
-	if(cdev_add(&c_dev,first, 1)== -1)
-	{
-		device_destroy(cls, first);
-		class_destroy(cls);
-		unregister_chrdev_region(first, 1);
-		return -1;
+
+	for (i = 0; i < num_devices; i++) {
+		d = imu_dev_alloc(i);
+		if (!d) {
+			ret = -ENOMEM;
+			goto err_devs;
+		}
+
+		//Step_3 link fops and cdev, then create the device node
+		cdev_init(&d->cdev, &fops);
+		d->cdev.owner = THIS_MODULE;
+		ret = cdev_add(&d->cdev, first + i, 1);
+		if (ret) {
+			imu_dev_free(d);
+			goto err_devs;
+		}
+		if (IS_ERR(device_create(cls, NULL, first + i, NULL,
+					 DEVICE_NAME "%u", i))) {
+			cdev_del(&d->cdev);
+			imu_dev_free(d);
+			ret = -ENOMEM;
+			goto err_devs;
+		}
+
+		//Step_4 start acquisition on the instance's own CPU
+		d->engine.next_ns = ktime_get_ns() + ktime_to_ns(d->sample_period);
+		if (smp_call_function_single(d->cpu, imu_start_timer, d, 1))
+			imu_start_timer(d);
+		imu_dev_debugfs(d);
+		imu_devs[i] = d;
 	}
 	return 0;
+
+err_devs:
+	while (i--)
+		imu_dev_remove(imu_devs[i]);
+	class_destroy(cls);
+err_region:
+	unregister_chrdev_region(first, num_devices);
+err_free:
+	debugfs_remove_recursive(imu_debugfs);
+	kfree(imu_devs);
+	return ret;
 }
 
 static void __exit imu_char_exit(void)
 {
-	cdev_del(&c_dev);
-	device_destroy(cls,first);
+	unsigned int i;
+
+	for (i = 0; i < num_devices; i++)
+		imu_dev_remove(imu_devs[i]);
 	class_destroy(cls);
-	unregister_chrdev_region(first, 1);
+	unregister_chrdev_region(first, num_devices);
+	debugfs_remove_recursive(imu_debugfs);
+	kfree(imu_devs);
 	printk(KERN_INFO "Bye: imu_char driver unregistered\n\n");
 }
 
@@ -1,218 +1,606 @@
+#include "libimu.h"
 
-#include "chardev.h"
-
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
 #include <stdio.h>
-#include <string.h>
-#include <sys/types.h>
-#include <sys/stat.h>
 #include <stdlib.h>
-#include <fcntl.h>              /* open */
-#include <unistd.h>             /* exit */
-#include <sys/ioctl.h>          /* ioctl */
-
-
-
- // Functions for the ioctl calls
- 
-u_int16_t buffer;
-
-int ioctl_gyroscope_x_axis (int file_desc, char *message)
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define BATCH 64	/* samples pulled per call */
+
+static const char *const channel_names[IMU_NUM_CHANNELS] = {
+	"x-axis measure from Gyroscope",
+	"Y-axis measure from Gyroscope",
+	"Z-axis measure from Gyroscope",
+	"x-axis measure from Accelerometer",
+	"Y-axis measure from Accelerometer",
+	"Z-axis measure from Accelerometer",
+	"x-axis measure from Magnetometer",
+	"Y-axis measure from Magnetometer",
+	"Z-axis measure from Magnetometer",
+	"Pressure in pascals obtained from Barometer",
+};
+
+static void print_sample(const struct imu_sample *s)
 {
-    int ret_val;
-    ret_val = ioctl(file_desc,IOCTL_GYROSCOPE_X_AXIS , message);
+	int i;
 
-    if (ret_val == 0) {
-        printf("ioctl_ failed:%d\n", ret_val);
-        exit(-1);
-    }
-    return 0;
+	printf("t=%llu ns:", (unsigned long long)s->timestamp_ns);
+	for (i = 0; i < IMU_NUM_CHANNELS; i++)
+		printf(" %u", s->channel[i]);
+	printf("\n");
 }
 
-int ioctl_gyroscope_y_axis(int file_desc, char *message)
+/* Interactive mode: one channel or a snapshot of all of them */
+static int menu(void)
 {
-    int ret_val;
-    ret_val = ioctl(file_desc, IOCTL_GYROSCOPE_Y_AXIS, message);
-
-    if (ret_val ==  0) {
-        printf("ioctl_get_msg failed:%d\n", ret_val);
-        exit(-1);
-    }
-    return 0;
+	struct imu_sample batch[BATCH];
+	struct imu_sample sample;
+	struct imu_client *c;
+	uint16_t value;
+	ssize_t n;
+	int i, select;
+
+	c = imu_open(NULL, 0);
+	if (!c) {
+		perror("Can't open device file: " DEVICE_FILE_NAME);
+		exit(-1);
+	}
+
+	printf("Select the option to be displayed from the below options:\n");
+	for (i = 0; i < IMU_NUM_CHANNELS; i++)
+		printf(" %d. %s\n", i + 1, channel_names[i]);
+	printf(" %d. All channels in one call\n", IMU_NUM_CHANNELS + 1);
+	if (scanf("%d", &select) != 1)
+		select = 0;
+
+	if (select >= 1 && select <= IMU_NUM_CHANNELS) {
+		/* one batched read, then the channel from its newest record */
+		n = imu_read_samples(c, batch, BATCH);
+		if (n < 0 || imu_read_channel(c, select - 1, &value) < 0) {
+			perror("read");
+			imu_close(c);
+			exit(-1);
+		}
+		printf("%s: %u (newest of %zd samples)\n",
+		       channel_names[select - 1], value, n);
+	} else if (select == IMU_NUM_CHANNELS + 1) {
+		if (imu_read_all(c, &sample) < 0) {
+			perror("imu_read_all");
+			imu_close(c);
+			exit(-1);
+		}
+		print_sample(&sample);
+	} else {
+		printf(" INVALID\n");
+	}
+
+	n = imu_read_samples(c, &sample, 1);
+	if (n == 1)
+		printf("queued sample t=%llu ns\n",
+		       (unsigned long long)sample.timestamp_ns);
+	imu_close(c);
+	return 0;
 }
 
-int ioctl_gyroscope_z_axis(int file_desc, char *message)
+/*
+ * Benchmark mode. Every thread opens its own file, so each has its own
+ * cursor on the ring, and pulls samples with the chosen access method
+ * for the whole run. Latency runs from a sample's timestamp to the
+ * moment the thread has it, on the same CLOCK_MONOTONIC.
+ */
+enum method { M_IOCTL, M_READ, M_READV, M_MMAP, M_URING, NUM_METHODS };
+
+static const char *const method_names[NUM_METHODS] = {
+	"ioctl", "read", "readv", "mmap", "io_uring",
+};
+
+struct bench_cfg {
+	const char *path;
+	uint32_t mask;
+	double duration;	/* seconds */
+	unsigned int batch;	/* samples per call, also the watermark */
+	unsigned int threads;
+	unsigned int rate;	/* Hz, 0 leaves the driver's */
+	enum method method;
+};
+
+/*
+ * Log-linear latency histogram: 16 buckets per power of two, so every
+ * bucket is within 1/16 of its lower bound.
+ */
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS ((64 - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+
+struct worker {
+	pthread_t tid;
+	const struct bench_cfg *cfg;
+	struct imu_client *c;
+	uint64_t samples;
+	uint64_t syscalls;
+	uint64_t max_ns;
+	uint64_t hist[LAT_BUCKETS];
+	int err;		/* errno that ended the run early */
+	volatile int done;
+};
+
+static volatile sig_atomic_t stop;
+
+static void on_signal(int sig)
 {
-    int ret_val;
-    ret_val = ioctl(file_desc,IOCTL_GYROSCOPE_Z_AXIS, message);
-
-    if (ret_val ==  0) {
-        printf("ioctl_get_msg failed:%d\n", ret_val);
-        exit(-1);
-    }
-    return 0;
+	(void)sig;	/* only here to interrupt blocking calls */
 }
 
-int ioctl_accelerometer_x_axis(int file_desc, char *message)
+static uint64_t now_ns(void)
 {
-    int ret_val;
-    ret_val = ioctl(file_desc, IOCTL_ACCELEROMETER_X_AXIS, message);
+	struct timespec ts;
 
-    if (ret_val ==  0) {
-        printf("ioctl_get_msg failed:%d\n", ret_val);
-        exit(-1);
-    }
-    return 0;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
 }
 
-int ioctl_accelerometer_y_axis(int file_desc, char *message)
+static unsigned int lat_bucket(uint64_t ns)
 {
-    int ret_val;
-    ret_val = ioctl(file_desc, IOCTL_ACCELEROMETER_Y_AXIS, message);
+	unsigned int e;
 
-    if (ret_val ==  0) {
-        printf("ioctl_get_msg failed:%d\n", ret_val);
-        exit(-1);
-    }
-    return 0;
+	if (ns < LAT_SUB)
+		return ns;
+	e = 63 - __builtin_clzll(ns);
+	return ((e - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+	       ((ns >> (e - LAT_SUB_BITS)) & (LAT_SUB - 1));
 }
 
-int ioctl_accelerometer_z_axis(int file_desc, char *message)
+static uint64_t lat_bucket_floor(unsigned int b)
 {
-    int ret_val;
-    ret_val = ioctl(file_desc, IOCTL_ACCELEROMETER_Z_AXIS, message);
+	unsigned int e = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
 
-    if (ret_val ==  0) {
-        printf("ioctl_get_msg failed:%d\n", ret_val);
-        exit(-1);
-    }
-    return 0;
+	if (b < LAT_SUB)
+		return b;
+	return (uint64_t)(LAT_SUB + (b & (LAT_SUB - 1))) << (e - LAT_SUB_BITS);
 }
 
-int ioctl_magnetometer_x_axis(int file_desc, char *message)
+static void note_sample(struct worker *w, uint64_t ts, uint64_t now)
 {
-    int ret_val;
-    ret_val = ioctl(file_desc, IOCTL_MAGNETOMETER_X_AXIS, message);
+	uint64_t lat = now > ts ? now - ts : 0;
 
-    if (ret_val ==  0) {
-        printf("ioctl_get_msg failed:%d\n", ret_val);
-        exit(-1);
-    }
-    return 0;
+	w->hist[lat_bucket(lat)]++;
+	if (lat > w->max_ns)
+		w->max_ns = lat;
+	w->samples++;
 }
 
-int ioctl_magnetometer_y_axis(int file_desc, char *message)
+/* Records in the file's scan layout all start with the timestamp */
+static void note_records(struct worker *w, const unsigned char *buf,
+			 size_t rec, size_t n)
 {
-    int ret_val;
-    ret_val = ioctl(file_desc, IOCTL_MAGNETOMETER_Y_AXIS, message);
-
-    if (ret_val ==  0) {
-        printf("ioctl_get_msg failed:%d\n", ret_val);
-        exit(-1);
-    }
-    return 0;
+	uint64_t now = now_ns();
+	uint64_t ts;
+	size_t i;
+
+	for (i = 0; i < n; i++) {
+		memcpy(&ts, buf + i * rec, sizeof(ts));
+		note_sample(w, ts, now);
+	}
 }
 
-int ioctl_magnetometer_z_axis(int file_desc, char *message)
+/* One IOCTL_READ_LATEST per call; a sample counts the first time seen */
+static void run_ioctl(struct worker *w)
 {
-    int ret_val;
-    ret_val = ioctl(file_desc, IOCTL_MAGNETOMETER_Z_AXIS, message);
-
-    if (ret_val ==  0) {
-        printf("ioctl_get_msg failed:%d\n", ret_val);
-        exit(-1);
-    }
-    return 0;
+	struct imu_sample s;
+	uint64_t last = 0;
+
+	while (!stop) {
+		w->syscalls++;
+		if (imu_read_latest(w->c, &s) < 0) {
+			w->err = errno;
+			return;
+		}
+		if (s.timestamp_ns != last) {
+			note_sample(w, s.timestamp_ns, now_ns());
+			last = s.timestamp_ns;
+		}
+	}
 }
 
-
-int ioctl_barometer_pressure(int file_desc, char *message)
+static void run_read(struct worker *w)
 {
-    int ret_val;
-    ret_val = ioctl(file_desc, IOCTL_BAROMETER_PRESSURE, message);
-
-    if (ret_val ==  0) {
-        printf("ioctl_get_msg failed:%d\n", ret_val);
-        exit(-1);
-    }
-    return 0;
+	size_t rec = IMU_SCAN_RECORD_SIZE(w->cfg->mask);
+	unsigned char *buf;
+	ssize_t n;
+
+	buf = malloc(w->cfg->batch * rec);
+	if (!buf) {
+		w->err = errno;
+		return;
+	}
+	while (!stop) {
+		w->syscalls++;
+		n = imu_read_records(w->c, buf, w->cfg->batch);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			w->err = errno;
+			break;
+		}
+		note_records(w, buf, rec, n);
+	}
+	free(buf);
 }
 
+/* One iovec per record */
+static void run_readv(struct worker *w)
+{
+	size_t rec = IMU_SCAN_RECORD_SIZE(w->cfg->mask);
+	unsigned int i, batch = w->cfg->batch;
+	unsigned char *buf;
+	struct iovec *iov;
+	ssize_t n;
+
+	buf = malloc(batch * rec);
+	iov = calloc(batch, sizeof(*iov));
+	if (!buf || !iov) {
+		w->err = errno;
+		goto out;
+	}
+	for (i = 0; i < batch; i++) {
+		iov[i].iov_base = buf + i * rec;
+		iov[i].iov_len = rec;
+	}
+	while (!stop) {
+		w->syscalls++;
+		n = readv(imu_fd(w->c), iov, batch);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			w->err = errno;
+			break;
+		}
+		note_records(w, buf, rec, n / rec);
+	}
+out:
+	free(iov);
+	free(buf);
+}
 
- // Main - Call the ioctl functions
- 
-int main()
+/* In place from the mapped ring; the only syscall is the wait */
+static void run_mmap(struct worker *w)
 {
-    int count,select;
-    int file_desc, ret_val;
-    char *msg = "Message passed by ioctl\n";
+	const struct imu_sample *s;
+	uint64_t now;
+
+	if (imu_map(w->c) < 0) {
+		w->err = errno;
+		return;
+	}
+	while (!stop) {
+		if (!imu_ring_begin(w->c)) {
+			w->syscalls++;
+			if (imu_wait(w->c) < 0 && errno != EINTR) {
+				w->err = errno;
+				return;
+			}
+			continue;
+		}
+		now = now_ns();
+		while ((s = imu_ring_next(w->c)))
+			note_sample(w, s->timestamp_ns, now);
+		imu_ring_end(w->c);
+	}
+}
 
-    file_desc = open(DEVICE_FILE_NAME, 0);
-    if (file_desc < 0) {
-        printf("Can't open device file: %s\n", DEVICE_FILE_NAME);
-        exit(-1);
-    }
+#ifdef HAVE_LIBURING
+/*
+ * One read in flight. The driver completes it inline when records are
+ * queued and otherwise from poll, never from an io-wq worker.
+ */
+static void run_uring(struct worker *w)
+{
+	size_t rec = IMU_SCAN_RECORD_SIZE(w->cfg->mask);
+	struct io_uring_sqe *sqe;
+	struct io_uring_cqe *cqe;
+	struct io_uring ring;
+	unsigned char *buf;
+	int ret, res;
+
+	buf = malloc(w->cfg->batch * rec);
+	if (!buf) {
+		w->err = errno;
+		return;
+	}
+	ret = io_uring_queue_init(4, &ring, 0);
+	if (ret < 0) {
+		w->err = -ret;
+		free(buf);
+		return;
+	}
+	while (!stop) {
+		sqe = io_uring_get_sqe(&ring);
+		io_uring_prep_read(sqe, imu_fd(w->c), buf, w->cfg->batch * rec, 0);
+		w->syscalls++;
+		ret = io_uring_submit_and_wait(&ring, 1);
+		while (ret == -EINTR && !stop)
+			ret = io_uring_wait_cqe(&ring, &cqe);
+		if (stop)
+			break;
+		if (ret < 0) {
+			w->err = -ret;
+			break;
+		}
+		ret = io_uring_peek_cqe(&ring, &cqe);
+		if (ret < 0) {
+			w->err = -ret;
+			break;
+		}
+		res = cqe->res;
+		io_uring_cqe_seen(&ring, cqe);
+		if (res < 0 && res != -EINTR) {
+			w->err = -res;
+			break;
+		}
+		if (res > 0)
+			note_records(w, buf, rec, res / rec);
+	}
+	/* cancels a read still waiting for samples */
+	io_uring_queue_exit(&ring);
+	free(buf);
+}
+#endif
 
-    printf("Select the option to be displayed from the below options:   \n");
-    
-    printf("1. x-axis measure from Gyroscope  \n 2. Y-axis measure from Gyroscope  \n 3. Z -axis measure from gyroscope \n 4. x-axis measure from Accelorometer  \n 5. Y-axis measure from accelerometer  \n 6. Z -axis measure from accelerometer \n 7. x-axis measure from magnetometer  \n 8. Y-axis measure from magnetometer  \n 9. Z -axis measure from magnetometer \n 10. Pressure in pascals obtained from Barometer ");
-    
-     scanf("%d",&select);
-     
-     switch(select)
-     {
-          case 1: ioctl_gyroscope_x_axis(file_desc,"1");
-                  break;
-          case 2: ioctl_gyroscope_y_axis(file_desc,"2");
-                  break;
-          case 3: ioctl_gyroscope_z_axis(file_desc,"3");
-                  break;
-          case 4: ioctl_accelerometer_x_axis(file_desc,"4");
-                  break;
-          case 5: ioctl_accelerometer_y_axis(file_desc,"5");
-                  break;
-          case 6: ioctl_accelerometer_z_axis(file_desc,"6");
-                  break;
-          case 7: ioctl_magnetometer_x_axis(file_desc,"7");
-                  break;
-          case 8: ioctl_magnetometer_y_axis(file_desc,"8");
-                  break;
-          case 9: ioctl_magnetometer_z_axis(file_desc,"9");
-                  break;
-          case 10:ioctl_barometer_pressure(file_desc,"10");
-                  break;
-          default: printf(" INVALID");
-                  break;
-     }  
- 
-    count = read(file_desc, &buffer, sizeof(buffer));
-    close(file_desc);
-    return 0;
-}
-
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-        
-	
+static void *worker_main(void *arg)
+{
+	struct worker *w = arg;
+
+	switch (w->cfg->method) {
+	case M_IOCTL:
+		run_ioctl(w);
+		break;
+	case M_READ:
+		run_read(w);
+		break;
+	case M_READV:
+		run_readv(w);
+		break;
+	case M_MMAP:
+		run_mmap(w);
+		break;
+	case M_URING:
+#ifdef HAVE_LIBURING
+		run_uring(w);
+#endif
+		break;
+	default:
+		break;
+	}
+	w->done = 1;
+	return NULL;
+}
 
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-m method] [-c mask] [-d seconds] [-n batch] [-t threads]\n"
+		"          [-r rate] [-D device]\n"
+		"  -m  ioctl, read, readv, mmap or io_uring (default read)\n"
+		"  -c  scan mask, e.g. 0x3ff for the raw channels (default all)\n"
+		"  -d  run time in seconds (default 5)\n"
+		"  -n  samples per call and watermark (default %d)\n"
+		"  -t  reader threads, one open file each (default 1)\n"
+		"  -r  sample rate in Hz (default: leave the driver's)\n"
+		"  -D  device node (default " DEVICE_FILE_NAME ")\n"
+		"Without options, runs the interactive menu.\n",
+		prog, BATCH);
+}
 
+static int parse_args(int argc, char **argv, struct bench_cfg *cfg)
+{
+	char *end;
+	int opt, i;
+
+	while ((opt = getopt(argc, argv, "m:c:d:n:t:r:D:h")) != -1) {
+		errno = 0;
+		switch (opt) {
+		case 'm':
+			for (i = 0; i < NUM_METHODS; i++)
+				if (!strcmp(optarg, method_names[i]))
+					break;
+			if (i == NUM_METHODS)
+				return -1;
+			cfg->method = i;
+			break;
+		case 'c':
+			cfg->mask = strtoul(optarg, &end, 0);
+			if (*end || errno || !cfg->mask ||
+			    (cfg->mask & ~IMU_SCAN_ALL))
+				return -1;
+			break;
+		case 'd':
+			cfg->duration = strtod(optarg, &end);
+			if (*end || errno || cfg->duration <= 0)
+				return -1;
+			break;
+		case 'n':
+			cfg->batch = strtoul(optarg, &end, 0);
+			if (*end || errno || !cfg->batch)
+				return -1;
+			break;
+		case 't':
+			cfg->threads = strtoul(optarg, &end, 0);
+			if (*end || errno || !cfg->threads)
+				return -1;
+			break;
+		case 'r':
+			cfg->rate = strtoul(optarg, &end, 0);
+			if (*end || errno || !cfg->rate)
+				return -1;
+			break;
+		case 'D':
+			cfg->path = optarg;
+			break;
+		default:
+			return -1;
+		}
+	}
+	return optind == argc ? 0 : -1;
+}
 
+static void report(const struct bench_cfg *cfg, struct worker *w,
+		   unsigned int threads, double secs)
+{
+	static const double pct[] = { 50, 90, 99, 99.9, 99.99 };
+	uint64_t samples = 0, syscalls = 0, max_ns = 0, seen, want;
+	static uint64_t hist[LAT_BUCKETS];
+	unsigned int i, b, p;
+
+	for (i = 0; i < threads; i++) {
+		samples += w[i].samples;
+		syscalls += w[i].syscalls;
+		if (w[i].max_ns > max_ns)
+			max_ns = w[i].max_ns;
+		for (b = 0; b < LAT_BUCKETS; b++)
+			hist[b] += w[i].hist[b];
+	}
+
+	printf("method %s, %u thread(s), batch %u, mask 0x%x, %.2f s\n",
+	       method_names[cfg->method], threads, cfg->batch, cfg->mask,
+	       secs);
+	printf("samples     %12llu  %12.0f /s\n",
+	       (unsigned long long)samples, samples / secs);
+	printf("syscalls    %12llu  %12.4f /sample\n",
+	       (unsigned long long)syscalls,
+	       samples ? (double)syscalls / samples : 0.0);
+	if (!samples)
+		return;
+
+	printf("latency percentile       ns\n");
+	for (p = 0, b = 0, seen = 0; p < sizeof(pct) / sizeof(pct[0]); p++) {
+		want = samples * pct[p] / 100;
+		if (want < 1)
+			want = 1;
+		while (b < LAT_BUCKETS && seen + hist[b] < want)
+			seen += hist[b++];
+		printf("  p%-6g  %14llu\n", pct[p],
+		       (unsigned long long)lat_bucket_floor(b));
+	}
+	printf("  max      %14llu\n", (unsigned long long)max_ns);
+}
 
+static int bench(int argc, char **argv)
+{
+	struct bench_cfg cfg = {
+		.path = NULL,
+		.mask = IMU_SCAN_ALL,
+		.duration = 5,
+		.batch = BATCH,
+		.threads = 1,
+		.method = M_READ,
+	};
+	struct sigaction sa;
+	struct imu_info info;
+	struct timespec ts;
+	struct worker *w;
+	unsigned int i, started;
+	uint64_t start;
+	int ret = 0;
+
+	if (parse_args(argc, argv, &cfg)) {
+		usage(argv[0]);
+		return 2;
+	}
+#ifndef HAVE_LIBURING
+	if (cfg.method == M_URING) {
+		fprintf(stderr, "built without liburing, see HAVE_LIBURING\n");
+		return 2;
+	}
+#endif
+	if (cfg.method == M_MMAP && cfg.threads > 1) {
+		fprintf(stderr, "only one file at a time may map the ring\n");
+		return 2;
+	}
+	if (cfg.method == M_READV && cfg.batch > sysconf(_SC_IOV_MAX)) {
+		fprintf(stderr, "readv batch is at most %ld\n",
+			sysconf(_SC_IOV_MAX));
+		return 2;
+	}
+
+	/* no SA_RESTART, so a blocked read returns EINTR */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = on_signal;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	w = calloc(cfg.threads, sizeof(*w));
+	if (!w) {
+		perror("calloc");
+		return 1;
+	}
+	for (i = 0; i < cfg.threads; i++) {
+		w[i].cfg = &cfg;
+		w[i].c = imu_open(cfg.path, 0);
+		if (!w[i].c) {
+			perror(cfg.path ? cfg.path : DEVICE_FILE_NAME);
+			ret = 1;
+			goto out;
+		}
+		if (imu_set_channels(w[i].c, cfg.mask) < 0 ||
+		    imu_get_info(w[i].c, &info) < 0 ||
+		    imu_set_watermark(w[i].c, cfg.batch < info.ring_size ?
+					      cfg.batch : info.ring_size) < 0) {
+			perror("configure");
+			ret = 1;
+			goto out;
+		}
+	}
+	if (cfg.rate && imu_set_rate(w[0].c, cfg.rate) < 0) {
+		perror("imu_set_rate");
+		ret = 1;
+		goto out;
+	}
+
+	start = now_ns();
+	for (started = 0; started < cfg.threads; started++) {
+		if (pthread_create(&w[started].tid, NULL, worker_main,
+				   &w[started])) {
+			fprintf(stderr, "pthread_create failed\n");
+			stop = 1;
+			ret = 1;
+			break;
+		}
+	}
+	if (!stop) {
+		ts.tv_sec = cfg.duration;
+		ts.tv_nsec = (cfg.duration - ts.tv_sec) * 1e9;
+		while (nanosleep(&ts, &ts) && errno == EINTR)
+			;
+		stop = 1;
+	}
+	for (i = 0; i < started; i++) {
+		/* a thread may block again between the signal and its check */
+		while (!w[i].done) {
+			pthread_kill(w[i].tid, SIGUSR1);
+			usleep(1000);
+		}
+		pthread_join(w[i].tid, NULL);
+		if (w[i].err) {
+			fprintf(stderr, "thread %u: %s\n", i, strerror(w[i].err));
+			ret = 1;
+		}
+	}
+	report(&cfg, w, started, (now_ns() - start) / 1e9);
+out:
+	for (i = 0; i < cfg.threads; i++)
+		imu_close(w[i].c);
+	free(w);
+	return ret;
+}
 
+int main(int argc, char **argv)
+{
+	return argc > 1 ? bench(argc, argv) : menu();
+}